@@ -0,0 +1,219 @@
+#include "Calibrate.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <map>
+
+/// Length of the sample clip when no toFrame is given
+static const int clipSeconds = 30;
+/// Stride of the reference pass, dense enough to see text that is on screen for a fraction of a second
+static const int referenceSkip = 3;
+/// Recall the picked parameters must keep
+static const float minRecall = 0.95f;
+/// Strides tried for each upscale, in order until recall drops
+static const int strideLadder[] = {6, 12, 24, 48, 96, 192};
+static const int upscaleLadder[] = {4, 3, 2};
+
+Calibrator::Calibrator(const Settings &settings, const CpuTopology &topology, const MatcherFactory &factory, VideoFile &video)
+	: settings(settings)
+	, topology(topology)
+	, factory(factory)
+	, video(video)
+{}
+
+bool Calibrator::run() {
+	trials.clear();
+	appearances.clear();
+	fps = video.video.get(cv::CAP_PROP_FPS);
+	fps = fps > 0. ? fps : 25.;
+	fromFrame = std::max(0, settings.fromFrame);
+	toFrame = settings.toFrame == -1 ? fromFrame + int(fps * clipSeconds) : settings.toFrame;
+	toFrame = std::min(toFrame, video.frameCount);
+	if (toFrame <= fromFrame) {
+		puts("Calibration clip is empty");
+		return false;
+	}
+
+	// one worker per free core, half as many and one per free logical CPU
+	const PlacementPlan plan = PlacementPlan::make(topology, settings, -1);
+	const int cores = plan.workerCount();
+	const int logical = std::max(cores, int(topology.cpus.size()) - int(plan.reservedCpus.size()));
+	std::vector<int> threadCounts = {cores, std::max(1, cores / 2), logical};
+	std::sort(threadCounts.begin(), threadCounts.end());
+	threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+	if (!engines.init(threadCounts.back())) {
+		puts("Failed to init recognition engines");
+		return false;
+	}
+
+	Trial reference;
+	reference.threadCount = cores;
+	reference.frameSkip = referenceSkip;
+	std::vector<MatchResult> results;
+	if (!runTrial(reference, results)) {
+		return false;
+	}
+
+	// matched samples of a rule no further apart than two reference strides are one appearance
+	std::map<int, std::vector<int>> ruleFrames;
+	for (const MatchResult &res : results) {
+		for (int rule : res.ruleIndices) {
+			ruleFrames[rule].push_back(res.frameIndex);
+		}
+	}
+	for (auto &pair : ruleFrames) {
+		std::vector<int> &frames = pair.second;
+		std::sort(frames.begin(), frames.end());
+		for (int frame : frames) {
+			if (appearances.empty() || appearances.back().rule != pair.first || frame - appearances.back().last > 2 * referenceSkip) {
+				appearances.push_back({pair.first, frame, frame});
+			} else {
+				appearances.back().last = frame;
+			}
+		}
+	}
+	if (!settings.silent) {
+		printf("Reference pass over frames [%d, %d): %d appearances of %d rules, %.2fx real time\n",
+			fromFrame, toFrame, int(appearances.size()), int(ruleFrames.size()), reference.speed);
+	}
+	if (appearances.empty()) {
+		puts("No matches in the calibration clip, recall can not be measured, pick a clip where the terms appear");
+		return false;
+	}
+
+	// thread count does not change what is found, only how fast
+	const int baseSkip = std::max(1, settings.frameSkip);
+	for (int threadCount : threadCounts) {
+		Trial trial;
+		trial.threadCount = threadCount;
+		trial.frameSkip = baseSkip;
+		if (!measure(trial)) {
+			return false;
+		}
+	}
+	const int threadCount = std::max_element(trials.begin(), trials.end(), [](const Trial &a, const Trial &b) {
+		return a.speed < b.speed;
+	})->threadCount;
+
+	for (int upscale : upscaleLadder) {
+		for (int frameSkip : strideLadder) {
+			Trial trial;
+			trial.threadCount = threadCount;
+			trial.frameSkip = frameSkip;
+			trial.upscale = upscale;
+			if (!measure(trial)) {
+				return false;
+			}
+			// larger strides only miss more
+			if (trials.back().recall < minRecall) {
+				break;
+			}
+		}
+	}
+
+	best = reference;
+	best.recall = 1.f;
+	for (const Trial &trial : trials) {
+		if (trial.recall >= minRecall && trial.speed > best.speed) {
+			best = trial;
+		}
+	}
+	if (!settings.silent) {
+		printf("Best: threadCount=%d frameSkip=%d upscale=%d, recall %.2f, %.2fx real time\n",
+			best.threadCount, best.frameSkip, best.upscale, best.recall, best.speed);
+	}
+	return true;
+}
+
+bool Calibrator::measure(Trial trial) {
+	for (const Trial &done : trials) {
+		if (done.threadCount == trial.threadCount && done.frameSkip == trial.frameSkip && done.upscale == trial.upscale) {
+			trials.push_back(done);
+			return true;
+		}
+	}
+	std::vector<MatchResult> results;
+	if (!runTrial(trial, results)) {
+		return false;
+	}
+	trial.recall = measureRecall(results);
+	trials.push_back(trial);
+	if (!settings.silent) {
+		printf("Trial threadCount=%d frameSkip=%d upscale=%d: recall %.2f, %.2fx real time\n",
+			trial.threadCount, trial.frameSkip, trial.upscale, trial.recall, trial.speed);
+		fflush(stdout);
+	}
+	return true;
+}
+
+bool Calibrator::runTrial(Trial &trial, std::vector<MatchResult> &results) {
+	using namespace std::chrono;
+
+	// plain index sampling over the clip, every match is needed for recall
+	Settings trialSettings = settings;
+	trialSettings.fromFrame = fromFrame;
+	trialSettings.toFrame = toFrame;
+	trialSettings.frameSkip = trial.frameSkip;
+	trialSettings.upscale = trial.upscale;
+	trialSettings.threadCount = trial.threadCount;
+	trialSettings.matchLimit = INT_MAX / 2;
+	trialSettings.adaptiveStride = false;
+	trialSettings.sampleMs = 0;
+	trialSettings.fromTime.clear();
+	trialSettings.toTime.clear();
+	trialSettings.intervals.clear();
+	trialSettings.resultDir.clear();
+	trialSettings.spillFrames = false;
+
+	ThreadedOCR threadedOCR(trialSettings, factory, video);
+	threadedOCR.placement = PlacementPlan::make(topology, trialSettings, trial.threadCount);
+	threadedOCR.engines = &engines;
+	const steady_clock::time_point start = steady_clock::now();
+	if (!threadedOCR.start(trial.threadCount)) {
+		puts("Failed to start threads");
+		return false;
+	}
+	threadedOCR.waitFinish();
+	const double seconds = std::max(0.001, duration_cast<duration<double>>(steady_clock::now() - start).count());
+
+	trial.speed = float((toFrame - fromFrame) / fps / seconds);
+	results = std::move(threadedOCR.results);
+	return true;
+}
+
+float Calibrator::measureRecall(const std::vector<MatchResult> &results) const {
+	std::map<int, std::vector<int>> ruleFrames;
+	for (const MatchResult &res : results) {
+		for (int rule : res.ruleIndices) {
+			ruleFrames[rule].push_back(res.frameIndex);
+		}
+	}
+	for (auto &pair : ruleFrames) {
+		std::sort(pair.second.begin(), pair.second.end());
+	}
+
+	// text may be on screen up to a reference stride before and after it was seen
+	int found = 0;
+	for (const Appearance &appearance : appearances) {
+		auto it = ruleFrames.find(appearance.rule);
+		if (it == ruleFrames.end()) {
+			continue;
+		}
+		auto frame = std::lower_bound(it->second.begin(), it->second.end(), appearance.first - referenceSkip);
+		found += frame != it->second.end() && *frame <= appearance.last + referenceSkip;
+	}
+	return float(found) / float(appearances.size());
+}
+
+bool Calibrator::writeProfile(const std::string &path) const {
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file) {
+		return false;
+	}
+	fprintf(file, "# Calibrated on %s frames [%d, %d), recall %.2f at %.2fx real time\n",
+		settings.videoPath.c_str(), fromFrame, toFrame, best.recall, best.speed);
+	fprintf(file, "-threadCount=%d\n-frameSkip=%d\n-upscale=%d\n", best.threadCount, best.frameSkip, best.upscale);
+	const bool isWritten = ferror(file) == 0;
+	return fclose(file) == 0 && isWritten;
+}
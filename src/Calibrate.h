@@ -0,0 +1,59 @@
+#pragma once
+
+#include "OCR.h"
+#include "Topology.h"
+
+#include <string>
+#include <vector>
+
+/// Tunes thread count, stride and upscale for this machine and this kind of content.
+/// A dense reference pass over a short sample clip finds every appearance of the terms, then short trials
+/// with other parameters are measured for speed and for recall of those appearances.
+/// The fastest trial that keeps recall is written as a settings profile, loaded again with -profile.
+struct Calibrator {
+	struct Trial {
+		int threadCount = 1;
+		int frameSkip = 1;
+		int upscale = 4;
+		float recall = 0.f; ///< Fraction of the reference appearances found
+		float speed = 0.f; ///< Seconds of video processed per second
+	};
+
+	Calibrator(const Settings &settings, const CpuTopology &topology, const MatcherFactory &factory, VideoFile &video);
+
+	/// Run the reference pass and the trials
+	/// @return false if the engines fail to start or the clip has no matches to measure recall on
+	bool run();
+
+	/// Write the parameters of the best trial in the format of -profile
+	bool writeProfile(const std::string &path) const;
+
+	std::vector<Trial> trials;
+	Trial best;
+private:
+	/// Appearance of a rule in the reference pass, consecutive matched samples of the same rule
+	struct Appearance {
+		int rule = -1;
+		int first = 0; ///< First matched frame
+		int last = 0; ///< Last matched frame
+	};
+
+	/// Process the clip with the trial's parameters and measure its speed
+	bool runTrial(Trial &trial, std::vector<MatchResult> &results);
+
+	/// Run a trial unless the same parameters were already measured, then add it to trials
+	bool measure(Trial trial);
+
+	float measureRecall(const std::vector<MatchResult> &results) const;
+
+	const Settings settings;
+	const CpuTopology &topology;
+	const MatcherFactory &factory;
+	VideoFile &video;
+	EnginePool engines;
+
+	int fromFrame = 0;
+	int toFrame = 0;
+	double fps = 25.;
+	std::vector<Appearance> appearances;
+};
@@ -0,0 +1,161 @@
+#include "Constraints.h"
+#include "TextNormalize.h"
+
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <set>
+#include <sstream>
+
+#if _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static int processId() {
+#if _WIN32
+	return _getpid();
+#else
+	return int(getpid());
+#endif
+}
+
+static int encodeUtf8(uint32_t cp, char *out) {
+	if (cp < 0x80) {
+		out[0] = char(cp);
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = char(0xC0 | (cp >> 6));
+		out[1] = char(0x80 | (cp & 0x3F));
+		return 2;
+	}
+	out[0] = char(0xE0 | (cp >> 12));
+	out[1] = char(0x80 | ((cp >> 6) & 0x3F));
+	out[2] = char(0x80 | (cp & 0x3F));
+	return 3;
+}
+
+static int utf8Length(uint8_t lead) {
+	return lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+}
+
+RecognizerConstraints::RecognizerConstraints(RecognizerConstraints &&other)
+	: whitelist(std::move(other.whitelist))
+	, userWordsFile(std::move(other.userWordsFile))
+	, checksum(other.checksum)
+{
+	other.userWordsFile.clear();
+}
+
+RecognizerConstraints &RecognizerConstraints::operator=(RecognizerConstraints &&other) {
+	if (this != &other) {
+		if (!userWordsFile.empty()) {
+			std::remove(userWordsFile.c_str());
+		}
+		whitelist = std::move(other.whitelist);
+		userWordsFile = std::move(other.userWordsFile);
+		checksum = other.checksum;
+		other.userWordsFile.clear();
+	}
+	return *this;
+}
+
+RecognizerConstraints::~RecognizerConstraints() {
+	if (!userWordsFile.empty()) {
+		std::remove(userWordsFile.c_str());
+	}
+}
+
+bool RecognizerConstraints::build(const Rulebook &rulebook, bool stripDiacritics, const std::string &dir) {
+	// characters of the normalized terms
+	std::set<std::string> termChars;
+	std::set<std::string> words;
+	for (int c = 0; c < int(rulebook.terms.size()); c++) {
+		const char *text = rulebook.termText(c);
+		const int length = rulebook.termLength(c);
+		for (int pos = 0; pos < length; pos += utf8Length(uint8_t(text[pos]))) {
+			if (text[pos] != ' ') {
+				termChars.insert(std::string(text + pos, std::min(utf8Length(uint8_t(text[pos])), length - pos)));
+			}
+		}
+		std::stringstream split(std::string(text, length));
+		std::string word;
+		while (split >> word) {
+			words.insert(word);
+		}
+	}
+
+	// every character of the scripts normalization knows about that becomes a term character,
+	// this brings in upper case and, if stripped, the letters with diacritics
+	std::set<std::string> allowed = termChars;
+	const uint32_t ranges[][2] = {{0x21, 0x250}, {0x370, 0x590}};
+	for (const auto &range : ranges) {
+		for (uint32_t cp = range[0]; cp < range[1]; cp++) {
+			char encoded[4] = {0,};
+			const int size = encodeUtf8(cp, encoded);
+			char normalized[4] = {0,};
+			memcpy(normalized, encoded, size);
+			const int length = normalizeText(normalized, size, stripDiacritics);
+			if (length == 0) {
+				continue;
+			}
+			bool isAllowed = true;
+			for (int pos = 0; pos < length && isAllowed; pos += utf8Length(uint8_t(normalized[pos]))) {
+				isAllowed = termChars.count(std::string(normalized + pos, std::min(utf8Length(uint8_t(normalized[pos])), length - pos))) != 0;
+			}
+			if (isAllowed) {
+				allowed.insert(std::string(encoded, size));
+			}
+		}
+	}
+	whitelist.clear();
+	for (const std::string &chr : allowed) {
+		whitelist += chr;
+	}
+
+	checksum = rulebook.checksum() ^ (stripDiacritics ? 0x9E3779B97F4A7C15ull : 0ull);
+	checksum = checksum ? checksum : 1;
+
+	std::error_code err;
+	const fs::path base = dir.empty() ? fs::temp_directory_path(err) : fs::path(dir);
+	if (err) {
+		return false;
+	}
+	// processes sharing the temporary directory must not delete each other's file
+	char name[80];
+	snprintf(name, sizeof(name), "legendary-waffle-words-%016" PRIx64 "-%d.txt", checksum, processId());
+	if (!userWordsFile.empty()) {
+		std::remove(userWordsFile.c_str());
+	}
+	userWordsFile = (base / name).string();
+
+	FILE *file = fopen(userWordsFile.c_str(), "w");
+	if (!file) {
+		return false;
+	}
+	for (const std::string &word : words) {
+		fprintf(file, "%s\n", word.c_str());
+		// terms are lower case, text on screen often is not
+		bool isAscii = true;
+		for (char chr : word) {
+			isAscii = isAscii && uint8_t(chr) < 0x80;
+		}
+		if (isAscii) {
+			std::string upper = word;
+			for (char &chr : upper) {
+				chr = char(toupper(uint8_t(chr)));
+			}
+			std::string capital = word;
+			capital[0] = char(toupper(uint8_t(capital[0])));
+			fprintf(file, "%s\n%s\n", capital.c_str(), upper.c_str());
+		}
+	}
+	const bool isWritten = ferror(file) == 0;
+	return fclose(file) == 0 && isWritten;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "RuleMatcher.h"
+
+#include <cstdint>
+#include <string>
+
+/// Recognizer settings derived from the rules, only the characters and words of the terms matter
+/// so the engine does not need to consider anything else:
+/// - character whitelist of every character that normalizes to a character of a term (both cases, with diacritics if stripped)
+/// - user words file with the words of all terms, favored by the dictionary over other words
+/// The user words file is owned by the constraints and deleted with them, engines read it only when they init.
+struct RecognizerConstraints {
+	RecognizerConstraints() = default;
+	RecognizerConstraints(const RecognizerConstraints &) = delete;
+	RecognizerConstraints &operator=(const RecognizerConstraints &) = delete;
+	RecognizerConstraints(RecognizerConstraints &&other);
+	RecognizerConstraints &operator=(RecognizerConstraints &&other);
+	~RecognizerConstraints();
+
+	/// @param dir where to write the user words file, system temporary directory if empty
+	/// @return false if the user words file can not be written
+	bool build(const Rulebook &rulebook, bool stripDiacritics, const std::string &dir);
+
+	/// No constraints, plain general purpose engine
+	bool isEmpty() const {
+		return checksum == 0;
+	}
+
+	std::string whitelist; ///< UTF-8 characters, empty allows any
+	std::string userWordsFile; ///< Unique to the process, empty if there is none
+	uint64_t checksum = 0; ///< Identifies the rules the constraints were built from, engines are rebuilt when it changes
+};
@@ -0,0 +1,400 @@
+#include "Daemon.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <afunix.h>
+typedef SOCKET Socket;
+static const Socket invalidSocket = INVALID_SOCKET;
+static void closeSocket(Socket sock) {
+	closesocket(sock);
+}
+static void shutdownSocket(Socket sock) {
+	shutdown(sock, SD_BOTH);
+}
+#else
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int Socket;
+static const Socket invalidSocket = -1;
+static void closeSocket(Socket sock) {
+	close(sock);
+}
+static void shutdownSocket(Socket sock) {
+	shutdown(sock, SHUT_RDWR);
+}
+#endif
+
+namespace fs = std::filesystem;
+
+struct Daemon::Client {
+	explicit Client(Socket sock) : sock(sock) {}
+
+	~Client() {
+		closeSocket(sock);
+	}
+
+	/// Send one response line, safe to call from the job thread while the client thread reads
+	void send(const std::string &line) {
+		lock_guard lock(writeMutex);
+		const std::string data = line + "\n";
+		size_t sent = 0;
+		while (sent < data.size()) {
+			const int res = int(::send(sock, data.c_str() + sent, int(data.size() - sent), 0));
+			if (res <= 0) {
+				return; // client went away, job keeps running
+			}
+			sent += size_t(res);
+		}
+	}
+
+	Socket sock;
+	std::mutex writeMutex;
+	std::atomic<bool> isDone{false}; ///< Set when serveClient returns, the thread can be joined
+};
+
+/// Thread serving one client, joined once the client is done
+struct Daemon::ClientThread {
+	std::thread thread;
+	std::weak_ptr<Client> client;
+
+	bool isDone() const {
+		const std::shared_ptr<Client> locked = client.lock();
+		return !locked || locked->isDone;
+	}
+};
+
+struct Daemon::Job {
+	int id = -1;
+	std::shared_ptr<Client> client;
+	Settings settings;
+};
+
+/// Split a request line on spaces, double quotes group words
+static std::vector<std::string> splitArgs(const std::string &line) {
+	std::vector<std::string> args;
+	std::string current;
+	bool inQuotes = false;
+	bool hasArg = false;
+	for (char c : line) {
+		if (c == '"') {
+			inQuotes = !inQuotes;
+			hasArg = true;
+		} else if (!inQuotes && (c == ' ' || c == '\t' || c == '\r')) {
+			if (hasArg) {
+				args.push_back(current);
+			}
+			current.clear();
+			hasArg = false;
+		} else {
+			current.push_back(c);
+			hasArg = true;
+		}
+	}
+	if (hasArg) {
+		args.push_back(current);
+	}
+	return args;
+}
+
+static std::string formatResult(int jobId, const MatchResult &res, const Rulebook &rulebook) {
+	char header[128];
+	snprintf(header, sizeof(header), "match %d frame=%d timeMs=%lld %s", jobId, res.frameIndex, (long long)res.frameTime.count(),
+		(res.matchType & MatchResult::HardMatch) ? "hard" : "soft");
+	std::string line = header;
+	for (int rule : res.ruleIndices) {
+		line += ' ';
+		line += rulebook.ruleName(rule);
+		char separator = '=';
+		for (const TermHit &hit : res.hits) {
+			if (hit.rule == rule) {
+				line += separator;
+				line += rulebook.hitText(hit);
+				separator = ',';
+			}
+		}
+	}
+	return line;
+}
+
+Daemon::Daemon(const Settings &settings, const PlacementPlan &placement)
+	: settings(settings)
+	, placement(placement)
+	, listenSocket(uintptr_t(invalidSocket))
+{}
+
+Daemon::~Daemon() {
+	if (Socket(listenSocket) != invalidSocket) {
+		closeSocket(Socket(listenSocket));
+		std::remove(settings.daemonSocket.c_str());
+	}
+#if _WIN32
+	WSACleanup();
+#endif
+}
+
+bool Daemon::init() {
+#if _WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		return false;
+	}
+#else
+	// writing to a client that went away must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (settings.daemonSocket.size() >= sizeof(addr.sun_path)) {
+		printf("Socket path too long %s\n", settings.daemonSocket.c_str());
+		return false;
+	}
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", settings.daemonSocket.c_str());
+	// socket file left over from a previous run
+	std::remove(settings.daemonSocket.c_str());
+
+	const Socket sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == invalidSocket) {
+		return false;
+	}
+	listenSocket = uintptr_t(sock);
+#if !_WIN32
+	// only the user running the daemon may connect, the socket is created with 0600
+	const mode_t oldMask = umask(0177);
+#endif
+	const bool isBound = bind(sock, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0;
+#if !_WIN32
+	umask(oldMask);
+#endif
+	if (!isBound || listen(sock, 16) != 0) {
+		printf("Failed to listen on %s\n", settings.daemonSocket.c_str());
+		return false;
+	}
+
+	if (!engines.init(std::max(1, placement.workerCount()))) {
+		puts("Failed to init recognition engines");
+		return false;
+	}
+
+	if (!settings.silent) {
+		printf("Daemon listening on %s with %d engines\n", settings.daemonSocket.c_str(), engines.size());
+		fflush(stdout);
+	}
+	return true;
+}
+
+void Daemon::run() {
+	std::thread jobThread(&Daemon::runJobs, this);
+	std::vector<ClientThread> clientThreads;
+
+	while (true) {
+		const Socket sock = accept(Socket(listenSocket), nullptr, nullptr);
+		if (sock == invalidSocket) {
+			break;
+		}
+		auto client = std::make_shared<Client>(sock);
+		{
+			lock_guard lock(jobMutex);
+			if (shouldStop) {
+				break;
+			}
+		}
+
+		// reap clients that disconnected so a long running daemon does not keep their threads
+		for (int c = 0; c < int(clientThreads.size());) {
+			if (clientThreads[c].isDone()) {
+				clientThreads[c].thread.join();
+				clientThreads[c] = std::move(clientThreads.back());
+				clientThreads.pop_back();
+			} else {
+				++c;
+			}
+		}
+		clientThreads.push_back({std::thread(&Daemon::serveClient, this, client), client});
+	}
+
+	requestStop();
+	jobThread.join();
+	// unblock clients waiting in recv
+	for (const ClientThread &clientThread : clientThreads) {
+		if (std::shared_ptr<Client> client = clientThread.client.lock()) {
+			shutdownSocket(client->sock);
+		}
+	}
+	for (ClientThread &clientThread : clientThreads) {
+		clientThread.thread.join();
+	}
+}
+
+void Daemon::requestStop() {
+	{
+		lock_guard lock(jobMutex);
+		if (shouldStop) {
+			return;
+		}
+		shouldStop = true;
+	}
+	jobCvar.notify_all();
+	// wakes up accept() in run()
+	shutdownSocket(Socket(listenSocket));
+}
+
+void Daemon::serveClient(std::shared_ptr<Client> client) {
+	std::string pending;
+	char buff[4096];
+	while (true) {
+		const int read = int(recv(client->sock, buff, sizeof(buff), 0));
+		if (read <= 0) {
+			break;
+		}
+		pending.append(buff, size_t(read));
+		size_t lineEnd;
+		while ((lineEnd = pending.find('\n')) != std::string::npos) {
+			const std::string line = pending.substr(0, lineEnd);
+			pending.erase(0, lineEnd + 1);
+			handleRequest(client, line);
+		}
+	}
+	client->isDone = true;
+}
+
+void Daemon::handleRequest(const std::shared_ptr<Client> &client, const std::string &line) {
+	std::vector<std::string> args = splitArgs(line);
+	if (args.empty()) {
+		return;
+	}
+
+	char reply[128];
+	if (args[0] == "status") {
+		lock_guard lock(jobMutex);
+		snprintf(reply, sizeof(reply), "status queue=%d running=%d", int(jobs.size()), runningJob);
+		client->send(reply);
+	} else if (args[0] == "shutdown") {
+		client->send("bye");
+		requestStop();
+	} else if (args[0] == "job") {
+		// parse the rest exactly like the command line
+		args[0] = "LegendaryWaffle";
+		std::vector<char *> argv;
+		for (std::string &arg : args) {
+			argv.push_back(&arg[0]);
+		}
+		argv.push_back(nullptr);
+
+		auto job = std::make_shared<Job>(Job{-1, client, Settings::getSettings(int(args.size()), argv.data())});
+		if (!job->settings.cmd.check() || job->settings.videoPath.empty() || job->settings.termsFile.empty()) {
+			client->send("error -1 job needs -video and -terms");
+			return;
+		}
+
+		int depth = 0;
+		{
+			lock_guard lock(jobMutex);
+			job->id = nextJobId++;
+			jobs.push_back(job);
+			depth = int(jobs.size());
+		}
+		jobCvar.notify_one();
+		snprintf(reply, sizeof(reply), "queued %d %d", job->id, depth);
+		client->send(reply);
+	} else {
+		client->send("error -1 unknown request " + args[0]);
+	}
+}
+
+void Daemon::runJobs() {
+	while (true) {
+		std::shared_ptr<Job> job;
+		{
+			unique_lock lock(jobMutex);
+			jobCvar.wait(lock, [this]() {
+				return shouldStop || !jobs.empty();
+			});
+			if (shouldStop) {
+				for (const std::shared_ptr<Job> &dropped : jobs) {
+					dropped->client->send("error " + std::to_string(dropped->id) + " daemon is shutting down");
+				}
+				jobs.clear();
+				return;
+			}
+			job = jobs.front();
+			jobs.pop_front();
+			runningJob = job->id;
+		}
+
+		runJob(*job);
+
+		lock_guard lock(jobMutex);
+		runningJob = -1;
+	}
+}
+
+void Daemon::runJob(Job &job) {
+	using namespace std::chrono;
+	const std::string jobId = std::to_string(job.id);
+	const steady_clock::time_point start = steady_clock::now();
+
+	std::shared_ptr<const MatcherFactory> factory = getRules(job.settings);
+	if (!factory) {
+		job.client->send("error " + jobId + " failed to load matchers from " + job.settings.termsFile);
+		return;
+	}
+
+	VideoFile video;
+	if (!video.init(job.settings)) {
+		job.client->send("error " + jobId + " failed to open " + job.settings.videoPath);
+		return;
+	}
+
+	ThreadedOCR threadedOCR(job.settings, *factory, video);
+	threadedOCR.placement = placement;
+	threadedOCR.engines = &engines;
+	threadedOCR.onResult = [&job, &factory](const MatchResult &res) {
+		job.client->send(formatResult(job.id, res, factory->rulebook));
+	};
+	if (!threadedOCR.start(engines.size())) {
+		job.client->send("error " + jobId + " failed to start threads");
+		return;
+	}
+	threadedOCR.waitFinish();
+
+	char reply[128];
+	snprintf(reply, sizeof(reply), "done %d matches=%d sampled=%d timedOut=%d timeMs=%lld", job.id, int(threadedOCR.results.size()),
+		threadedOCR.sampledCount(), int(threadedOCR.timedOutFrames.size()),
+		(long long)duration_cast<milliseconds>(steady_clock::now() - start).count());
+	job.client->send(reply);
+}
+
+std::shared_ptr<const MatcherFactory> Daemon::getRules(const Settings &jobSettings) {
+	std::error_code err;
+	const fs::file_time_type modified = fs::last_write_time(jobSettings.termsFile, err);
+	if (err) {
+		return nullptr;
+	}
+
+	const std::string key = jobSettings.termsFile + (jobSettings.stripDiacritics ? "|strip" : "");
+	lock_guard lock(rulesMutex);
+	auto it = rules.find(key);
+	if (it != rules.end() && it->second.modified == modified) {
+		return it->second.factory;
+	}
+
+	auto factory = std::make_shared<MatcherFactory>();
+	factory->matchersFile = jobSettings.termsFile;
+	factory->stripDiacritics = jobSettings.stripDiacritics;
+	if (!factory->init()) {
+		return nullptr;
+	}
+	rules[key] = {factory, modified};
+	return factory;
+}
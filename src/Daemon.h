@@ -0,0 +1,65 @@
+#pragma once
+
+#include "OCR.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// Long running mode that keeps recognition engines and compiled rules warm and takes jobs over a local socket.
+/// The protocol is line based, one request per line:
+///   job <arguments>  queue a job, arguments are the same as on the command line (-video=... -terms=... -fromFrame=...)
+///                    replies "queued <id> <depth>", then one "match <id> ..." line per result while the job runs
+///                    and "done <id> ..." or "error <id> <message>" when it finishes
+///   status           replies "status queue=<depth> running=<job id or -1>"
+///   shutdown         finish the running job and exit
+struct Daemon {
+	Daemon(const Settings &settings, const PlacementPlan &placement);
+	~Daemon();
+
+	/// Create the socket and initialize the engines
+	bool init();
+
+	/// Serve clients until shutdown is requested
+	void run();
+
+private:
+	struct Client;
+	struct ClientThread;
+	struct Job;
+
+	struct CachedRules {
+		std::shared_ptr<const MatcherFactory> factory;
+		std::filesystem::file_time_type modified;
+	};
+
+	void serveClient(std::shared_ptr<Client> client);
+	void handleRequest(const std::shared_ptr<Client> &client, const std::string &line);
+	void runJobs();
+	void runJob(Job &job);
+	void requestStop();
+
+	/// Get compiled rules for a terms file, reloaded only if the file changed
+	std::shared_ptr<const MatcherFactory> getRules(const Settings &jobSettings);
+
+	const Settings settings;
+	const PlacementPlan placement;
+	EnginePool engines;
+	uintptr_t listenSocket;
+
+	std::mutex jobMutex;
+	std::condition_variable jobCvar;
+	std::deque<std::shared_ptr<Job>> jobs;
+	int nextJobId = 0;
+	int runningJob = -1;
+	bool shouldStop = false;
+
+	std::mutex rulesMutex;
+	std::map<std::string, CachedRules> rules;
+};
@@ -0,0 +1,139 @@
+#include "FrameStore.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <chrono>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+static size_t matBytes(const cv::Mat &mat) {
+	return mat.total() * mat.elemSize();
+}
+
+FrameStore::~FrameStore() {
+	clear();
+}
+
+bool FrameStore::init(const Settings &settings) {
+	clear();
+	budget = size_t(std::max(0, settings.resultMemoryMB)) << 20;
+	spill = settings.spillFrames;
+	if (!spill) {
+		return true;
+	}
+
+	std::error_code err;
+	fs::path dir = settings.spillDir.empty() ? fs::temp_directory_path(err) : fs::path(settings.spillDir);
+	if (err) {
+		return false;
+	}
+	// unique per instance, several processes can share the same spill directory
+	const long long stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+	dir /= "legendary-waffle-" + std::to_string(stamp) + "-" + std::to_string(reinterpret_cast<uintptr_t>(this));
+	if (!fs::create_directories(dir, err)) {
+		printf("Failed to create spill directory %s\n", dir.string().c_str());
+		return false;
+	}
+	spillDir = dir.string();
+	return true;
+}
+
+std::string FrameStore::spillPath(int handle) const {
+	char name[64];
+	snprintf(name, sizeof(name), "frame-%d.jpeg", handle);
+	return (fs::path(spillDir) / name).string();
+}
+
+int FrameStore::put(const cv::Mat &frame) {
+	struct Victim {
+		int handle;
+		cv::Mat frame;
+	};
+	std::vector<Victim> victims;
+	int handle = -1;
+	{
+		lock_guard lock(mutex);
+		handle = int(entries.size());
+		Entry entry;
+		entry.frame = frame;
+		entry.bytes = matBytes(frame);
+		entries.push_back(entry);
+		resident += entry.bytes;
+
+		// never evict the frame just added, it would be written out right away
+		while (resident > budget && nextEviction < handle) {
+			Entry &old = entries[nextEviction];
+			if (old.state == State::Resident) {
+				old.state = State::Evicting;
+				resident -= old.bytes;
+				victims.push_back({nextEviction, old.frame});
+			}
+			++nextEviction;
+		}
+	}
+
+	// slow part is done without holding the lock, get() still sees the frame while Evicting
+	for (Victim &victim : victims) {
+		cv::Mat thumbnail;
+		bool isSpilled = false;
+		if (spill) {
+			isSpilled = cv::imwrite(spillPath(victim.handle), victim.frame, {cv::IMWRITE_JPEG_QUALITY, 95});
+		}
+		if (!isSpilled) {
+			const double factor = std::min(1., double(thumbnailWidth) / victim.frame.cols);
+			cv::resize(victim.frame, thumbnail, {}, factor, factor, cv::INTER_AREA);
+		}
+
+		lock_guard lock(mutex);
+		Entry &entry = entries[victim.handle];
+		if (isSpilled) {
+			entry.state = State::Spilled;
+			entry.frame.release();
+			++spilled;
+		} else {
+			entry.state = State::Thumbnail;
+			entry.frame = thumbnail;
+			entry.bytes = matBytes(thumbnail);
+			resident += entry.bytes;
+		}
+	}
+	return handle;
+}
+
+cv::Mat FrameStore::get(int handle) {
+	{
+		lock_guard lock(mutex);
+		if (handle < 0 || handle >= int(entries.size())) {
+			return cv::Mat();
+		}
+		if (entries[handle].state != State::Spilled) {
+			return entries[handle].frame;
+		}
+	}
+	// not cached again, viewers only need the frame for a short time
+	return cv::imread(spillPath(handle));
+}
+
+void FrameStore::clear() {
+	lock_guard lock(mutex);
+	entries.clear();
+	resident = 0;
+	nextEviction = 0;
+	spilled = 0;
+	if (!spillDir.empty()) {
+		std::error_code err;
+		fs::remove_all(spillDir, err);
+		spillDir.clear();
+	}
+}
+
+size_t FrameStore::residentBytes() const {
+	lock_guard lock(mutex);
+	return resident;
+}
+
+int FrameStore::spilledCount() const {
+	lock_guard lock(mutex);
+	return spilled;
+}
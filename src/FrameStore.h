@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Utils.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// Keeps the frames of match results within a memory budget.
+/// When over budget the oldest frames are spilled to a temporary directory and reloaded on demand,
+/// or shrunk to thumbnails if spilling is disabled. Thread safe.
+struct FrameStore {
+	FrameStore() = default;
+	FrameStore(const FrameStore &) = delete;
+	FrameStore &operator=(const FrameStore &) = delete;
+	~FrameStore();
+
+	bool init(const Settings &settings);
+
+	/// Store a frame, does not copy the pixels
+	/// @return handle to pass to get()
+	int put(const cv::Mat &frame);
+
+	/// Get a stored frame, loading it back from disk if it was spilled
+	/// @return empty Mat for invalid handle or failed load
+	cv::Mat get(int handle);
+
+	/// Remove all frames and spilled files
+	void clear();
+
+	size_t residentBytes() const;
+
+	int spilledCount() const;
+
+private:
+	enum class State {
+		Resident,
+		Evicting, ///< Chosen for eviction, frame is still valid until the spill/shrink finishes
+		Spilled,
+		Thumbnail,
+	};
+
+	struct Entry {
+		cv::Mat frame;
+		State state = State::Resident;
+		size_t bytes = 0;
+	};
+
+	std::string spillPath(int handle) const;
+
+	mutable std::mutex mutex;
+	std::vector<Entry> entries;
+	size_t budget = 0;
+	size_t resident = 0;
+	int nextEviction = 0; ///< Frames are evicted oldest first
+	int spilled = 0;
+	bool spill = true;
+	int thumbnailWidth = 320;
+	std::string spillDir;
+};
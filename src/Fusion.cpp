@@ -0,0 +1,137 @@
+#include "Fusion.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+/// Minimum intersection over union for two blocks to be the same region
+static const float minOverlap = 0.5f;
+
+static float overlap(const cv::Rect &a, const cv::Rect &b) {
+	const int common = (a & b).area();
+	if (common == 0) {
+		return 0.f;
+	}
+	return float(common) / float(a.area() + b.area() - common);
+}
+
+static bool isSameText(const TextBlock &a, const TextBlock &b) {
+	return a.text.size() == b.text.size() && memcmp(a.text.get(), b.text.get(), a.text.size()) == 0;
+}
+
+/// Block that overlaps the region most, nullptr if none overlaps enough
+static const TextBlock *findRegion(const TextBlock &region, const BlockList &blocks) {
+	const TextBlock *best = nullptr;
+	float bestOverlap = minOverlap;
+	for (const TextBlock &block : blocks) {
+		const float current = overlap(region.bbox, block.bbox);
+		if (current >= bestOverlap) {
+			best = &block;
+			bestOverlap = current;
+		}
+	}
+	return best;
+}
+
+void FusionWindow::init(const Settings &settings) {
+	entries.clear();
+	nextVote = 0;
+	claimed = -1;
+	depth = std::max(0, settings.fusionWindow);
+	const int stride = std::max(1, settings.adaptiveStride ? settings.maxStride : settings.frameSkip);
+	maxDistance = depth * stride;
+}
+
+void FusionWindow::add(int frameIndex, ms frameTime, const cv::Mat &frame, BlockList &&blocks) {
+	Entry entry;
+	entry.frameIndex = frameIndex;
+	entry.frameTime = frameTime;
+	entry.frame = frame;
+	entry.blocks = std::move(blocks);
+	entries.push_back(std::move(entry));
+}
+
+void FusionWindow::addCandidate(const TextBlock &block) {
+	for (Candidate &candidate : candidates) {
+		if (isSameText(*candidate.block, block)) {
+			++candidate.votes;
+			candidate.confidence += block.confidence;
+			return;
+		}
+	}
+	candidates.push_back({&block, 1, block.confidence});
+}
+
+bool FusionWindow::next(int floor, FusedFrame &fused) {
+	if (nextVote >= int(entries.size())) {
+		return false;
+	}
+	const Entry &center = entries[nextVote];
+	// later samples can still come in between unless depth of them are in or the floor is past the window
+	const int after = int(entries.size()) - nextVote - 1;
+	if (after < depth && floor - center.frameIndex <= maxDistance) {
+		return false;
+	}
+
+	fused.sampleIndex = center.frameIndex;
+	fused.blocks.clear();
+	const int first = std::max(0, nextVote - depth);
+	const int last = std::min(int(entries.size()) - 1, nextVote + depth);
+	weights.assign(entries.size(), 0.f);
+	for (const TextBlock &region : center.blocks) {
+		// the frame's own reading is first and only loses to more votes or more confidence
+		readings.clear();
+		readings.push_back({nextVote, &region});
+		for (int c = first; c <= last; c++) {
+			if (c != nextVote && std::abs(entries[c].frameIndex - center.frameIndex) <= maxDistance) {
+				if (const TextBlock *block = findRegion(region, entries[c].blocks)) {
+					readings.push_back({c, block});
+				}
+			}
+		}
+		candidates.clear();
+		for (const Reading &reading : readings) {
+			addCandidate(*reading.block);
+		}
+		const Candidate *winner = &candidates.front();
+		for (const Candidate &candidate : candidates) {
+			if (candidate.votes > winner->votes || (candidate.votes == winner->votes && candidate.confidence > winner->confidence)) {
+				winner = &candidate;
+			}
+		}
+		for (const Reading &reading : readings) {
+			if (isSameText(*reading.block, *winner->block)) {
+				weights[reading.entry] += reading.block->confidence;
+			}
+		}
+		TextBlock block = winner->block->copy();
+		block.bbox = region.bbox;
+		block.confidence = winner->confidence / float(winner->votes);
+		fused.blocks.push_back(std::move(block));
+	}
+
+	// the frame itself wins ties, a neighbour needs to have read some winner
+	int best = center.frameIndex > claimed ? nextVote : -1;
+	for (int c = first; c <= last; c++) {
+		if (entries[c].frameIndex > claimed && weights[c] > 0.f && (best == -1 || weights[c] > weights[best])) {
+			best = c;
+		}
+	}
+	if (best == -1) {
+		fused.frameIndex = -1;
+		fused.frameTime = center.frameTime;
+		fused.frame = cv::Mat();
+	} else {
+		fused.frameIndex = entries[best].frameIndex;
+		fused.frameTime = entries[best].frameTime;
+		fused.frame = entries[best].frame;
+	}
+
+	++nextVote;
+	// keep depth voted frames for the ones still to vote on
+	while (nextVote > depth) {
+		entries.pop_front();
+		--nextVote;
+	}
+	return true;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "Utils.h"
+#include "RuleMatcher.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <deque>
+
+/// Sample with the voted readings of its regions, ready to be matched
+struct FusedFrame {
+	int sampleIndex = -1; ///< Frame that was voted on
+	int frameIndex = -1; ///< Best frame a match is reported at, -1 if every frame that read the winners is already reported
+	ms frameTime = ms(0); ///< Of the best frame
+	cv::Mat frame; ///< Best frame
+	BlockList blocks; ///< One block per region of the sample, bbox of the sample's own block
+};
+
+/// Sliding window of the recognized blocks of consecutive samples, filled in frame order by the thread collecting results.
+/// A noisy frame often misreads text that a neighbouring sample got right, so each region of a frame (overlapping bboxes)
+/// is voted on with the same region in up to depth samples on both sides: the reading most samples agree on wins,
+/// then the one with the higher total confidence, then the frame's own reading.
+/// Only regions present in the frame itself are voted on, text that went away does not come back.
+/// A frame is voted on only once the samples after it are in, so the outcome does not depend on which worker finished first.
+/// A match is attributed to the best frame: the one whose readings won the most, weighted by their confidence,
+/// among the frames after the last one reported so results stay in frame order and no frame is reported twice.
+struct FusionWindow {
+	void init(const Settings &settings);
+
+	bool isEnabled() const {
+		return depth > 0;
+	}
+
+	/// Add the blocks of a recognized frame, frames are added in frame order
+	void add(int frameIndex, ms frameTime, const cv::Mat &frame, BlockList &&blocks);
+
+	/// Vote on the oldest frame not voted on yet, if all its neighbours are in
+	/// @param floor every recognized frame before it was added, INT_MAX if all were
+	/// @return false if there is no such frame
+	bool next(int floor, FusedFrame &fused);
+
+	/// A match was reported at this frame, later matches are attributed to frames after it
+	void claim(int frameIndex) {
+		claimed = frameIndex;
+	}
+
+private:
+	struct Entry {
+		int frameIndex = -1;
+		ms frameTime;
+		cv::Mat frame;
+		BlockList blocks;
+	};
+
+	/// Reading of a region and how many samples agree on it
+	struct Candidate {
+		const TextBlock *block = nullptr;
+		int votes = 0;
+		float confidence = 0.f; ///< Sum over the samples
+	};
+
+	/// Reading of a region in one sample
+	struct Reading {
+		int entry = 0; ///< Position in entries
+		const TextBlock *block = nullptr;
+	};
+
+	void addCandidate(const TextBlock &block);
+
+	int depth = 0; ///< Number of samples on each side to vote with
+	int maxDistance = 0; ///< Frames further away are not neighbours
+
+	std::deque<Entry> entries; ///< In frame order, up to depth voted frames before the next one
+	int nextVote = 0; ///< Position of the next frame to vote on in entries
+	int claimed = -1; ///< Last frame a match was reported at
+	std::vector<Reading> readings;
+	std::vector<Candidate> candidates;
+	std::vector<float> weights; ///< Confidence of the winning readings of each sample in the vote
+};
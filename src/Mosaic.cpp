@@ -0,0 +1,117 @@
+#include "Mosaic.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+
+/// Smallest text line that can be recognized, in source pixels
+static const int minTextHeight = 8;
+/// Context kept around each region
+static const int cellPadding = 4;
+/// Minimum empty space between cells, grows with the text height
+static const int minCellGap = 8;
+/// Shelves are not made narrower than this
+static const int minMosaicWidth = 1024;
+/// A mosaic that is not smaller than this fraction of the plain area is not worth it
+static const float maxMosaicArea = 0.6f;
+
+static bool isTouching(const cv::Rect &a, const cv::Rect &b) {
+	const cv::Rect grown{a.x - 1, a.y - 1, a.width + 2, a.height + 2};
+	return (grown & b).area() > 0;
+}
+
+void MosaicBatcher::findTextRegions(const cv::Mat &gray, const std::vector<cv::Rect> &within, std::vector<cv::Rect> &found) {
+	found.clear();
+	const cv::Rect whole{{0, 0}, gray.size()};
+	cv::morphologyEx(gray, gradient, cv::MORPH_GRADIENT, cv::getStructuringElement(cv::MORPH_RECT, {3, 3}));
+	cv::threshold(gradient, mask, 0., 255., cv::THRESH_BINARY | cv::THRESH_OTSU);
+	// join letters of a word and words of a line
+	cv::morphologyEx(mask, mask, cv::MORPH_CLOSE, cv::getStructuringElement(cv::MORPH_RECT, {15, 3}));
+	cv::findContours(mask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+
+	for (const std::vector<cv::Point> &contour : contours) {
+		const cv::Rect box = cv::boundingRect(contour);
+		if (box.height < minTextHeight || box.width < minTextHeight || box.height > gray.rows / 3) {
+			continue;
+		}
+		const cv::Rect padded = cv::Rect{box.x - cellPadding, box.y - cellPadding, box.width + 2 * cellPadding, box.height + 2 * cellPadding} & whole;
+		for (const cv::Rect &area : within) {
+			const cv::Rect clipped = padded & area;
+			if (clipped.height >= minTextHeight && clipped.width >= minTextHeight) {
+				found.push_back(clipped);
+			}
+		}
+	}
+
+	// overlapping regions would show the same text twice
+	for (int c = 0; c < int(found.size()); c++) {
+		for (int r = c + 1; r < int(found.size()); r++) {
+			if (isTouching(found[c], found[r])) {
+				found[c] |= found[r];
+				found.erase(found.begin() + r);
+				r = c;
+			}
+		}
+	}
+}
+
+bool MosaicBatcher::layout(const std::vector<cv::Rect> &regions, int plainArea) {
+	cells.clear();
+	size = {};
+	if (regions.empty()) {
+		return true;
+	}
+
+	std::vector<int> order(regions.size());
+	int widest = 0;
+	for (int c = 0; c < int(regions.size()); c++) {
+		order[c] = c;
+		widest = std::max(widest, regions[c].width);
+	}
+	std::sort(order.begin(), order.end(), [&regions](int a, int b) {
+		return regions[a].height > regions[b].height;
+	});
+
+	const int maxWidth = std::max(widest, minMosaicWidth);
+	int x = 0, y = 0, shelfHeight = 0, gap = 0;
+	for (int idx : order) {
+		const cv::Rect &region = regions[idx];
+		if (x > 0 && x + region.width > maxWidth) {
+			y += shelfHeight + gap;
+			x = 0;
+		}
+		if (x == 0) {
+			// first cell is the tallest on the shelf, gaps as wide as a line is tall keep words of cells apart
+			shelfHeight = region.height;
+			gap = std::max(minCellGap, shelfHeight);
+		}
+		cells.push_back({region, cv::Rect{x, y, region.width, region.height}});
+		size.width = std::max(size.width, x + region.width);
+		x += region.width + gap;
+	}
+	size.height = y + shelfHeight;
+
+	return float(size.area()) <= maxMosaicArea * float(plainArea);
+}
+
+void MosaicBatcher::compose(const cv::Mat &gray, cv::Mat &mosaic) const {
+	mosaic.create(size, CV_8UC1);
+	// background in the gaps is the average of the frame, without strong edges that could be taken for text
+	mosaic.setTo(cv::mean(gray));
+	for (const Cell &cell : cells) {
+		gray(cell.source).copyTo(mosaic(cell.placed));
+	}
+}
+
+int MosaicBatcher::findCell(const cv::Rect &box) const {
+	int best = -1;
+	int bestArea = 0;
+	for (int c = 0; c < int(cells.size()); c++) {
+		const int area = (cells[c].placed & box).area();
+		if (area > bestArea) {
+			best = c;
+			bestArea = area;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+/// Packs the small text regions of a frame into one compact image, so they are recognized in a single pass
+/// instead of running layout analysis over a mostly empty upscaled frame or one pass per region.
+/// Cells are spaced so Tesseract does not join text of neighbouring cells, recognized lines are mapped back
+/// to the cell they came from.
+struct MosaicBatcher {
+	struct Cell {
+		cv::Rect source; ///< Region in the source frame
+		cv::Rect placed; ///< Same region in the mosaic
+	};
+
+	/// Find regions that look like text, strong local contrast joined horizontally into lines
+	/// @param within only regions inside these rectangles are returned, clipped to them
+	void findTextRegions(const cv::Mat &gray, const std::vector<cv::Rect> &within, std::vector<cv::Rect> &found);
+
+	/// Place the regions on shelves
+	/// @param plainArea area recognized without the mosaic
+	/// @return false if the mosaic would not be much smaller than plainArea
+	bool layout(const std::vector<cv::Rect> &regions, int plainArea);
+
+	/// Copy the cells from the gray frame into the mosaic
+	void compose(const cv::Mat &gray, cv::Mat &mosaic) const;
+
+	/// @return index of the cell a box in mosaic coordinates belongs to, -1 if it is in the gaps
+	int findCell(const cv::Rect &box) const;
+
+	cv::Size size; ///< Size of the mosaic
+	std::vector<Cell> cells;
+private:
+	cv::Mat gradient;
+	cv::Mat mask;
+	std::vector<std::vector<cv::Point>> contours;
+};
@@ -1,10 +1,14 @@
 #include "OCR.h"
+#include "TextNormalize.h"
 
 #include <leptonica/allheaders.h>
 #include <tesseract/renderer.h>
 
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <algorithm>
+#include <map>
+
 bool VideoFile::init(const Settings &settings) {
 	video.open(settings.videoPath);
 	if (!video.isOpened()) {
@@ -66,54 +70,123 @@ ms VideoFile::frameToMs(int index) {
 	return ms(int(video.get(cv::CAP_PROP_POS_MSEC)));
 }
 
+bool VideoFile::grab() {
+	if (!video.grab()) {
+		return false;
+	}
+	++frameIndex;
+	frameTime = ms(int64_t(video.get(cv::CAP_PROP_POS_MSEC)));
+	return true;
+}
+
+bool VideoFile::retrieve(cv::Mat &frame) {
+	return video.retrieve(frame) && !frame.empty();
+}
+
+void VideoFile::seek(ms time) {
+	video.set(cv::CAP_PROP_POS_MSEC, double(time.count()));
+	// next grab() is the frame at this position
+	frameIndex = int(video.get(cv::CAP_PROP_POS_FRAMES)) - 1;
+	frameTime = ms(int64_t(video.get(cv::CAP_PROP_POS_MSEC)));
+}
+
 VideoFile::~VideoFile() {
 	video.release();
 }
 
-bool TesseractCTX::init(int idx) {
+bool TesseractCTX::init(int idx, const RecognizerConstraints &constraints, tesseract::OcrEngineMode mode) {
 	index = idx;
-	if (tesseract.Init(TESSDATA_DIR, "eng", tesseract::OEM_TESSERACT_LSTM_COMBINED) != 0) {
+	this->mode = mode;
+	// dictionaries are loaded only at init
+	GenericVector<STRING> names, values;
+	if (!constraints.userWordsFile.empty()) {
+		names.push_back(STRING("user_words_file"));
+		values.push_back(STRING(constraints.userWordsFile.c_str()));
+	}
+	if (tesseract.Init(TESSDATA_DIR, "eng", mode, nullptr, 0, &names, &values, false) != 0) {
 		return false;
 	}
 	tesseract.SetPageSegMode(tesseract::PSM_AUTO_OSD);
 	char fileName[128] = {0,};
-	snprintf(fileName, sizeof(fileName), "tesseract-%d.log", index);
+	snprintf(fileName, sizeof(fileName), mode == tesseract::OEM_TESSERACT_ONLY ? "tesseract-screen-%d.log" : "tesseract-%d.log", index);
 	tesseract.SetVariable("tessedit_write_images", "1");
 	tesseract.SetVariable("debug_file", fileName);
+	if (!constraints.isEmpty()) {
+		tesseract.SetVariable("tessedit_char_whitelist", constraints.whitelist.c_str());
+		// words outside the terms are only a reason to keep looking
+		tesseract.SetVariable("language_model_penalty_non_dict_word", "0.3");
+		tesseract.SetVariable("language_model_penalty_non_freq_dict_word", "0.2");
+	}
+	constraintsChecksum = constraints.checksum;
 	return true;
 }
 
-void TesseractCTX::orcImage(const cv::Mat& frame) {
-	tesseract.SetImage(frame.data, frame.cols, frame.rows, 1, int(frame.step));
-	tesseract.Recognize(nullptr);
+bool TesseractCTX::constrain(const RecognizerConstraints &constraints) {
+	if (constraints.checksum == constraintsChecksum) {
+		return true;
+	}
+	tesseract.End();
+	return init(index, constraints, mode);
 }
 
-OCR::OCR(const MatcherFactory &factory, int totalFrames)
-	: totalFrames(totalFrames)
-{
-	factory.create(ruleSet);
+bool EnginePool::init(int count) {
+	engines.clear();
+	for (int c = 0; c < count; c++) {
+		std::unique_ptr<TesseractCTX> engine(new TesseractCTX);
+		if (!engine->init(c)) {
+			return false;
+		}
+		engines.push_back(std::move(engine));
+	}
+	return true;
 }
 
-static void makePrintable(CharPtr &ptr) {
-	int len = int(strlen(ptr.get()));
-	int step = 0;
-	for (int c = 0; c <= len; c++) {
-		if (ptr[c] == '\t' || ptr[c] == '\n' || ptr[c] == '\r') {
-			++step;
-		} else {
-			ptr[c - step] = ptr[c];
-		}
+TesseractCTX *EnginePool::get(int idx) {
+	return idx >= 0 && idx < size() ? engines[idx].get() : nullptr;
+}
+
+TesseractCTX::~TesseractCTX() {
+	if (image) {
+		pixDestroy(&image);
 	}
-	len -= step;
+}
 
-	step = 0;
-	for (int c = 0; c <= len; c++) {
-		if (ptr[c] == ' ' && c < len && ptr[c + 1] == ' ') {
-			step++;
-		} else {
-			ptr[c - step] = ptr[c];
-		}
+cv::Mat TesseractCTX::getImageBuffer(int width, int height) {
+	if (image && (pixGetWidth(image) != width || pixGetHeight(image) != height)) {
+		pixDestroy(&image);
+	}
+	if (!image) {
+		image = pixCreateNoInit(width, height, 8);
 	}
+	// Pix rows are padded to whole 32 bit words
+	return cv::Mat(height, width, CV_8UC1, pixGetData(image), size_t(pixGetWpl(image)) * 4);
+}
+
+static bool isCancelled(void *cancelThis, int /*words*/) {
+	return cancelThis && static_cast<const std::atomic<bool> *>(cancelThis)->load();
+}
+
+TesseractCTX::Status TesseractCTX::orcImage(const std::atomic<bool> *cancel, int budgetMs) {
+	assert(image);
+	// Leptonica keeps 8 bit pixels in native 32 bit words, the Mat wrote them in memory order
+	pixEndianByteSwap(image);
+	tesseract.SetImage(image);
+	ETEXT_DESC monitor;
+	monitor.cancel = isCancelled;
+	monitor.cancel_this = const_cast<std::atomic<bool> *>(cancel);
+	if (budgetMs > 0) {
+		monitor.set_deadline_msecs(budgetMs);
+	}
+	if (tesseract.Recognize(&monitor) == 0) {
+		return Done;
+	}
+	return monitor.deadline_exceeded() ? TimedOut : Cancelled;
+}
+
+OCR::OCR(const MatcherFactory &factory, int totalFrames)
+	: totalFrames(totalFrames)
+{
+	factory.create(ruleSet);
 }
 
 static int clamp(int value, int min, int max) {
@@ -129,17 +202,201 @@ cv::Rect operator/(const cv::Rect &rect, float factor) {
 	return res;
 }
 
-void OCR::processFrame(FrameProcessContext &ctx, const cv::Mat& sourceFrame, ms frameTime) {
-	assert(!ruleSet.isEmpty() && "Empty rule set");
-	result.frameIndex = ctx.frameIndex;
-	const int percent = int(float(ctx.frameIndex) / totalFrames * 100);
-	if (ctx.settings.verbose) {
-		printf("Thread[%d]: Processing frame [%d/%d] %d%%\n", ctx.recognizer.index, ctx.frameIndex, totalFrames, percent);
-		fflush(stdout);
+TesseractCTX::Status OCR::recognizeBlocks(FrameProcessContext &ctx, const cv::Mat &sourceFrame) {
+	using namespace std::chrono;
+	const steady_clock::time_point start = steady_clock::now();
+	// budget is for the whole frame, not for each recognition pass
+	auto remainingBudget = [&ctx, &start]() {
+		if (ctx.settings.frameBudgetMs <= 0) {
+			return 0;
+		}
+		return std::max(1, ctx.settings.frameBudgetMs - int(duration_cast<milliseconds>(steady_clock::now() - start).count()));
+	};
+
+	const cv::Rect area = ctx.settings.doCrop ? cv::Rect{0, 0, sourceFrame.cols / 2, sourceFrame.rows} : cv::Rect{{0, 0}, sourceFrame.size()};
+	regions.clear();
+	if (ctx.regionCache) {
+		ctx.regionCache->plan(ctx.frameIndex, sourceFrame, regionThumb, blocks, regions);
+		for (const TextBlock &block : blocks) {
+			cv::rectangle(sourceFrame, block.bbox, {255, 0, 0});
+		}
+		for (cv::Rect &region : regions) {
+			region &= area;
+		}
+		regions.erase(std::remove_if(regions.begin(), regions.end(), [](const cv::Rect &region) {
+			return region.empty();
+		}), regions.end());
+	} else {
+		regions.push_back(area);
+	}
+
+	TesseractCTX::Status status = TesseractCTX::Done;
+	if (ctx.screener) {
+		candidates.clear();
+		for (const cv::Rect &region : regions) {
+			status = screenRegion(ctx, sourceFrame, region, remainingBudget());
+			if (status != TesseractCTX::Done) {
+				return status;
+			}
+		}
+		// lines of one paragraph are recognized together
+		for (int c = 0; c < int(candidates.size()); c++) {
+			for (int r = c + 1; r < int(candidates.size()); r++) {
+				if ((candidates[c] & candidates[r]).area() > 0) {
+					candidates[c] |= candidates[r];
+					candidates.erase(candidates.begin() + r);
+					r = c;
+				}
+			}
+		}
+		regions.swap(candidates);
+		cascade.escalatedRegions += int(regions.size());
+	}
+
+	if (ctx.settings.mosaic && !regions.empty() && planMosaic(sourceFrame)) {
+		status = recognizeMosaic(ctx, sourceFrame, remainingBudget());
+	} else {
+		for (const cv::Rect &region : regions) {
+			status = recognizeRegion(ctx, sourceFrame, region, remainingBudget());
+			if (status != TesseractCTX::Done) {
+				break;
+			}
+		}
+	}
+
+	if (status == TesseractCTX::Done && ctx.regionCache) {
+		ctx.regionCache->store(ctx.frameIndex, sourceFrame.size(), regionThumb, blocks);
+	}
+	return status;
+}
+
+TesseractCTX::Status OCR::screenRegion(FrameProcessContext &ctx, const cv::Mat &sourceFrame, const cv::Rect &region, int budgetMs) {
+	// a quarter of the pixels of the full pass, enough to tell which lines could hold a term
+	const int scale = std::max(1, upscale / 2);
+	cv::cvtColor(sourceFrame(region), gray, cv::COLOR_BGR2GRAY);
+	toImageBuffer(gray, *ctx.screener, scale);
+	const TesseractCTX::Status status = ctx.screener->orcImage(&ctx.shouldStop, budgetMs);
+	if (status != TesseractCTX::Done) {
+		return status;
+	}
+
+	std::unique_ptr<tesseract::ResultIterator> iter(ctx.screener->tesseract.GetIterator());
+	if (!iter) {
+		assert(false);
+		return status;
+	}
+
+	const Rulebook &rulebook = ruleSet.rulebook();
+	iter->Begin();
+	do {
+		if (iter->Empty(tesseract::RIL_TEXTLINE)) {
+			continue;
+		}
+		int left, top, right, bottom;
+		if (!iter->BoundingBox(tesseract::RIL_TEXTLINE, &left, &top, &right, &bottom)) {
+			continue;
+		}
+		++cascade.screenedLines;
+		CharPtr text(iter->GetUTF8Text(tesseract::RIL_TEXTLINE));
+		const int len = normalizeText(text.get(), int(strlen(text.get())), ctx.settings.stripDiacritics);
+		if (!rulebook.mayContainTerm(text.get(), len)) {
+			continue;
+		}
+		++cascade.escalatedLines;
+		// the first stage can clip the line, keep half a line of context around it
+		cv::Rect line = cv::Rect{{left, top}, cv::Size{right - left, bottom - top}} / float(scale);
+		const int pad = std::max(4, line.height / 2);
+		line = cv::Rect{line.x + region.x - pad, line.y + region.y - pad, line.width + 2 * pad, line.height + 2 * pad};
+		candidates.push_back(line & region);
+	} while (iter->Next(tesseract::RIL_TEXTLINE));
+	return status;
+}
+
+bool OCR::planMosaic(const cv::Mat &sourceFrame) {
+	cv::cvtColor(sourceFrame, gray, cv::COLOR_BGR2GRAY);
+	mosaic.findTextRegions(gray, regions, textRegions);
+	int plainArea = 0;
+	for (const cv::Rect &region : regions) {
+		plainArea += region.area();
+	}
+	return mosaic.layout(textRegions, plainArea);
+}
+
+TesseractCTX::Status OCR::recognizeMosaic(FrameProcessContext &ctx, const cv::Mat &sourceFrame, int budgetMs) {
+	if (mosaic.cells.empty()) {
+		// nothing that looks like text, nothing to recognize
+		return TesseractCTX::Done;
+	}
+	mosaic.compose(gray, mosaicImage);
+	toImageBuffer(mosaicImage, ctx.recognizer, upscale);
+	const TesseractCTX::Status status = ctx.recognizer.orcImage(&ctx.shouldStop, budgetMs);
+	if (status != TesseractCTX::Done) {
+		return status;
+	}
+
+	std::unique_ptr<tesseract::ResultIterator> iter(ctx.recognizer.tesseract.GetIterator());
+	if (!iter) {
+		assert(false);
+		return status;
+	}
+
+	// lines are mapped to cells, all lines of a cell make one block like a paragraph of a whole frame would
+	std::vector<std::string> cellText(mosaic.cells.size());
+	std::vector<cv::Rect> cellBox(mosaic.cells.size());
+	std::vector<float> cellConfidence(mosaic.cells.size(), 0.f);
+	std::vector<int> cellLines(mosaic.cells.size(), 0);
+	iter->Begin();
+	do {
+		if (iter->Empty(tesseract::RIL_TEXTLINE)) {
+			continue;
+		}
+		int left, top, right, bottom;
+		if (!iter->BoundingBox(tesseract::RIL_TEXTLINE, &left, &top, &right, &bottom)) {
+			continue;
+		}
+		const cv::Rect placedBox = cv::Rect{{left, top}, cv::Size{right - left, bottom - top}} / float(upscale);
+		const int cell = mosaic.findCell(placedBox);
+		if (cell == -1) {
+			continue;
+		}
+		const MosaicBatcher::Cell &where = mosaic.cells[cell];
+		cv::Rect box = placedBox & where.placed;
+		box.x += where.source.x - where.placed.x;
+		box.y += where.source.y - where.placed.y;
+
+		CharPtr text(iter->GetUTF8Text(tesseract::RIL_TEXTLINE));
+		cellText[cell] += text.get();
+		cellBox[cell] = cellLines[cell] == 0 ? box : (cellBox[cell] | box);
+		cellConfidence[cell] += iter->Confidence(tesseract::RIL_TEXTLINE);
+		++cellLines[cell];
+	} while (iter->Next(tesseract::RIL_TEXTLINE));
+
+	for (int c = 0; c < int(mosaic.cells.size()); c++) {
+		if (cellLines[c] == 0) {
+			continue;
+		}
+		const std::string &text = cellText[c];
+		CharPtr data(new char[text.size() + 1]);
+		memcpy(data.get(), text.c_str(), text.size() + 1);
+		const int len = normalizeText(data.get(), int(text.size()), ctx.settings.stripDiacritics);
+
+		TextBlock block;
+		block.text = CharPtrView(std::move(data), len);
+		block.bbox = cellBox[c];
+		block.confidence = cellConfidence[c] / float(cellLines[c]);
+		cv::rectangle(sourceFrame, block.bbox, {255, 0, 0});
+		blocks.push_back(std::move(block));
+	}
+	return status;
+}
+
+TesseractCTX::Status OCR::recognizeRegion(FrameProcessContext &ctx, const cv::Mat &sourceFrame, const cv::Rect &region, int budgetMs) {
+	preprocessFrame(sourceFrame(region), ctx.recognizer);
+	const float factor = float(upscale);
+	const TesseractCTX::Status status = ctx.recognizer.orcImage(&ctx.shouldStop, budgetMs);
+	if (status != TesseractCTX::Done) {
+		return status;
 	}
-	const cv::Mat processed = preprocessFrame(ctx.settings, sourceFrame);
-	const float factor = float(processed.cols) / sourceFrame.cols;
-	ctx.recognizer.orcImage(processed);
 #if 0
 	Pix *thImage = recognizer.tesseract.GetThresholdedImage();
 	char buff[64];
@@ -148,99 +405,154 @@ void OCR::processFrame(FrameProcessContext &ctx, const cv::Mat& sourceFrame, ms
 	pixDestroy(&thImage);
 #endif
 
-	tesseract::ResultIterator* iter = ctx.recognizer.tesseract.GetIterator();
+	std::unique_ptr<tesseract::ResultIterator> iter(ctx.recognizer.tesseract.GetIterator());
 	if (!iter) {
 		assert(false);
-		return;
+		return status;
 	}
 
-	const cv::Scalar red = {0, 0, 255};
 	iter->Begin();
 	do {
 		if (iter->Empty(tesseract::RIL_PARA)) {
 			continue;
 		}
-		CharPtrView textView;
+		TextBlock block;
 		{
 			CharPtr text(iter->GetUTF8Text(tesseract::RIL_PARA));
-			const int len = int(strlen(text.get()));
-			std::transform(text.get(), text.get() + len, text.get(), [](char c) {
-				return char(tolower(c));
-			});
-			textView = CharPtrView(std::move(text), len);
+			const int len = normalizeText(text.get(), int(strlen(text.get())), ctx.settings.stripDiacritics);
+			block.text = CharPtrView(std::move(text), len);
 		}
 
 		int left, top, right, bottom;
 		if (iter->BoundingBox(tesseract::RIL_PARA, &left, &top, &right, &bottom)) {
-			const cv::Rect bbox = cv::Rect{{left, top}, cv::Size{right - left, bottom - top}} / factor;
-			cv::rectangle(sourceFrame, bbox, {255, 0, 0});
-			ruleSet.addBlock(textView, bbox);
+			block.bbox = cv::Rect{{left, top}, cv::Size{right - left, bottom - top}} / factor;
+			block.bbox.x += region.x;
+			block.bbox.y += region.y;
+			block.confidence = iter->Confidence(tesseract::RIL_PARA);
+			cv::rectangle(sourceFrame, block.bbox, {255, 0, 0});
+			blocks.push_back(std::move(block));
 		}
 	} while (iter->Next(tesseract::RIL_PARA));
+	return status;
+}
 
-	std::string matchName;
-	const MatcherList &whitelist = ruleSet.getWhitelist();
-	for (int c = 0; c < int(whitelist.size()); c++) {
-		if (!whitelist[c].isMatchFound()) {
-			continue;
+TesseractCTX::Status OCR::processFrame(FrameProcessContext &ctx, const cv::Mat& sourceFrame, ms frameTime) {
+	assert(!ruleSet.isEmpty() && "Empty rule set");
+	result.frameIndex = ctx.frameIndex;
+	result.frameTime = frameTime;
+	const int percent = int(float(ctx.frameIndex) / totalFrames * 100);
+	if (ctx.settings.verbose) {
+		printf("Thread[%d]: Processing frame [%d/%d] %d%%\n", ctx.recognizer.index, ctx.frameIndex, totalFrames, percent);
+		fflush(stdout);
+	}
+	const TesseractCTX::Status status = recognizeBlocks(ctx, sourceFrame);
+	if (status == TesseractCTX::TimedOut) {
+		timedOut = true;
+		if (ctx.settings.verbose) {
+			printf("Thread[%d]: Frame [%d] over the %dms budget, skipped\n", ctx.recognizer.index, ctx.frameIndex, ctx.settings.frameBudgetMs);
+			fflush(stdout);
 		}
-		if (whitelist[c].descriptor().isSoftMatch) {
+	}
+	if (status != TesseractCTX::Done) {
+		return status;
+	}
+
+	ruleSet.setFrameSize(sourceFrame.size());
+	for (const TextBlock &block : blocks) {
+		ruleSet.addBlock(block.text, block.bbox);
+	}
+	if (ctx.screener) {
+		for (const cv::Rect &region : regions) {
+			const HitList &hits = ruleSet.getHits();
+			cascade.confirmedRegions += std::any_of(hits.begin(), hits.end(), [&region](const TermHit &hit) {
+				return (hit.bbox & region).area() > 0;
+			});
+		}
+	}
+	if (!ctx.isFused) {
+		matchRules(ctx.settings, sourceFrame);
+	}
+	return status;
+}
+
+void OCR::matchFused(const Settings &settings, const FusedFrame &fused) {
+	clear();
+	result.frameIndex = fused.frameIndex;
+	result.frameTime = fused.frameTime;
+	ruleSet.setFrameSize(fused.frame.size());
+	for (const TextBlock &block : fused.blocks) {
+		ruleSet.addBlock(block.text, block.bbox);
+	}
+	matchRules(settings, fused.frame);
+}
+
+void OCR::matchRules(const Settings &settings, const cv::Mat &sourceFrame) {
+	ruleSet.finishFrame();
+
+	const Rulebook &rulebook = ruleSet.rulebook();
+	ruleSet.getMatchedRules(matchedRules);
+	for (int rule : matchedRules) {
+		if (rulebook.rules[rule].isSoftMatch) {
 			result.matchType = MatchResult::MatchType(result.matchType | MatchResult::SoftMatch);
 		} else {
 			result.matchType = MatchResult::MatchType(result.matchType | MatchResult::HardMatch);
 		}
-		if (matchName.empty()) {
-			matchName = whitelist[c].descriptor().name;
-		}
-		for (const auto& match : whitelist[c].getMatchedTerms()) {
-			cv::rectangle(sourceFrame, match.bbox, red);
+		result.ruleIndices.push_back(rule);
+	}
+
+	for (const TermHit &hit : ruleSet.getHits()) {
+		if (ruleSet.isMatchFound(hit.rule)) {
+			result.hits.push_back(hit);
 		}
-		result.whitelistIndices.push_back(c);
 	}
 
-	// dbg(sourceFrame);
+	if (result.matchType == MatchResult::NoMatch) {
+		return;
+	}
 
-	if (result.matchType != MatchResult::NoMatch) {
-		assert(!matchName.empty());
-		// only first match frame is saved
-		if ((result.matchType & MatchResult::HardMatch) != 0 && ctx.isFirstMatch.exchange(false) == true) {
-			result.frame = sourceFrame;
-		}
+	cv::Mat resultFrame = sourceFrame;
+	const cv::Scalar red = {0, 0, 255};
+	for (const TermHit &hit : result.hits) {
+		cv::rectangle(resultFrame, hit.bbox, red);
+	}
 
-		if (!ctx.settings.resultDir.empty()) {
-			char path[256]{0,};
-			snprintf(path, sizeof(path), "%s/frame-%s.jpeg", ctx.settings.resultDir.c_str(), timeToString(frameTime).c_str());
-			cv::imwrite(path, sourceFrame);
-		}
+	// dbg(resultFrame);
 
-		if (result.matchType & MatchResult::HardMatch) {
-			const int matchIndex = ctx.matchIndex.fetch_add(1);
-			printf("Match found frame: [%d], [%s]  %d/%d\n", result.frameIndex, matchName.c_str(), matchIndex + 1, ctx.settings.matchLimit);
-			fflush(stdout);
-		} else if (result.matchType & MatchResult::SoftMatch) {
-			printf("Soft match found frame: [%d], [%s]\n", result.frameIndex, matchName.c_str());
-			fflush(stdout);
-		}
-		result.ruleSet = ruleSet;
+	// stored only once the result is released, results past the matchLimit never are
+	if (result.matchType & MatchResult::HardMatch) {
+		result.frame = resultFrame;
+	}
+
+	if (!settings.resultDir.empty()) {
+		char path[256]{0,};
+		snprintf(path, sizeof(path), "%s/frame-%s.jpeg", settings.resultDir.c_str(), timeToString(result.frameTime).c_str());
+		cv::imwrite(path, resultFrame);
 	}
 }
 
 void OCR::clear() {
-	result.whitelistIndices.clear();
+	timedOut = false;
+	blocks.clear();
+	result.ruleIndices.clear();
+	result.hits.clear();
 	ruleSet.clear();
+	result.frameHandle = -1;
 	result.frame.release();
 	result.frameIndex = -1;
 	result.matchType = MatchResult::NoMatch;
 }
 
-cv::Mat OCR::preprocessFrame(const Settings &settings, cv::Mat input) const {
-	cv::Mat processed = input.clone();
-	if (settings.doCrop) {
-		processed = processed.colRange(0, int(processed.cols / 2));
-	}
-	// zoom 2x to enable small text recognition
-	cv::resize(input, processed, {}, 4., 4., cv::INTER_CUBIC);
-	cv::cvtColor(processed, processed, cv::COLOR_BGR2GRAY);
+cv::Mat OCR::preprocessFrame(const cv::Mat &input, TesseractCTX &recognizer) {
+	// convert before zooming, the color image is never scaled up
+	cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+	return toImageBuffer(gray, recognizer, upscale);
+}
+
+cv::Mat OCR::toImageBuffer(const cv::Mat &image, TesseractCTX &recognizer, int scale) {
+	// zoom to enable small text recognition, straight into the image Tesseract reads
+	cv::Mat processed = recognizer.getImageBuffer(image.cols * scale, image.rows * scale);
+	cv::resize(image, processed, processed.size(), 0., 0., cv::INTER_CUBIC);
+	assert(processed.data == reinterpret_cast<uchar *>(pixGetData(recognizer.image)) && "resize reallocated the image buffer");
 	//dbg(processed);
 
 	//cv::threshold(frame, frame, 128., 255., cv::THRESH_OTSU | cv::THRESH_BINARY_INV);
@@ -250,23 +562,121 @@ cv::Mat OCR::preprocessFrame(const Settings &settings, cv::Mat input) const {
 	return processed;
 }
 
+/// Finished frames a worker can be ahead of the collecting thread before it waits
+static const int finishedCapacity = 64;
+/// Longest the collecting thread sleeps, wake ups are not under a lock and can be missed
+static const ms collectInterval = ms(20);
+
+void ResultOrder::init(int workerCount, int reach) {
+	workers.clear();
+	for (int c = 0; c < workerCount; c++) {
+		workers.push_back(std::make_unique<Worker>(finishedCapacity));
+	}
+	lowestNext = INT_MIN;
+	this->reach = std::max(0, reach);
+	pending.clear();
+}
+
+void ResultOrder::begin(int worker, int frameIndex) {
+	workers[worker]->current.store(frameIndex);
+}
+
+bool ResultOrder::finish(int worker, Finished &done) {
+	Worker &own = *workers[worker];
+	if ((done.result.matchType != MatchResult::NoMatch || done.timedOut || !done.frame.empty()) && !own.queue.push(done)) {
+		return false;
+	}
+	// only after the queue, a frame that is not current any more must have its result in the queue
+	own.current.store(INT_MAX);
+	return true;
+}
+
+void ResultOrder::setLowestNext(int frameIndex) {
+	lowestNext.store(frameIndex);
+}
+
+int ResultOrder::collect(bool isFinal, std::vector<Finished> &released, std::vector<int> &timedOut) {
+	// read in the opposite order of the workers: a sampled frame becomes current before the lowest next moves past it,
+	// and its result is queued before it stops being current, so no frame is missed in between
+	int floor = isFinal ? INT_MAX : lowestNext.load();
+	for (const std::unique_ptr<Worker> &worker : workers) {
+		floor = std::min(floor, worker->current.load());
+	}
+	for (const std::unique_ptr<Worker> &worker : workers) {
+		while (worker->queue.pop(finished)) {
+			if (finished.timedOut) {
+				timedOut.push_back(finished.frameIndex);
+			}
+			if (finished.result.matchType != MatchResult::NoMatch || !finished.frame.empty()) {
+				pending.emplace(finished.frameIndex, std::move(finished));
+			}
+		}
+	}
+
+	// a sample still to take can pick a frame up to reach frames before it
+	const int first = isFinal ? INT_MAX : floor < INT_MIN + reach ? INT_MIN : floor - reach;
+	const auto end = isFinal ? pending.end() : pending.lower_bound(first);
+	for (auto it = pending.begin(); it != end; ++it) {
+		released.push_back(std::move(it->second));
+	}
+	pending.erase(pending.begin(), end);
+	return first;
+}
+
+int ResultOrder::findHardMatch(int count) const {
+	for (const auto &pair : pending) {
+		if ((pair.second.result.matchType & MatchResult::HardMatch) != 0 && --count == 0) {
+			return pair.first;
+		}
+	}
+	return INT_MAX;
+}
+
 ThreadedOCR::ThreadedOCR(const Settings &settings, const MatcherFactory &factory, VideoFile &video)
 	: settings(settings)
 	, factory(factory)
 	, video(video)
-	, maxFrame(video.frameCount)
 	, remainingMatches(settings.matchLimit)
-	, frameSkip(settings.frameSkip)
 {}
 
 bool ThreadedOCR::start(int count) {
 	shouldStop = false;
-	maxFrame = video.frameCount;
-	const int threadCount = count == -1 ? std::thread::hardware_concurrency() : count;
-	if (threadCount == 1) {
+	const int endFrame = settings.toFrame == -1 ? video.frameCount : std::min(settings.toFrame, video.frameCount);
+	sampler.init(settings, std::max(0, settings.fromFrame), endFrame);
+	if (!timeSampler.init(settings, video.video.get(cv::CAP_PROP_FPS))) {
+		puts("Invalid time range, expected seconds or hh:mm:ss");
+		return false;
+	}
+	picker.init(settings);
+	if (!frames.init(settings)) {
+		return false;
+	}
+	constraints = RecognizerConstraints();
+	if (settings.ruleConstraints && !constraints.build(factory.rulebook, settings.stripDiacritics, "")) {
+		puts("Failed to write the user words file");
+		return false;
+	}
+	if (settings.ruleConstraints && settings.verbose) {
+		printf("Recognizer constrained to %s\n", constraints.whitelist.c_str());
+	}
+	int threadCount = count == -1 ? std::max(1, placement.workerCount()) : count;
+	if (engines) {
+		threadCount = std::min(threadCount, engines->size());
+	}
+	cascade = CascadeStats();
+	fusion.init(settings);
+	fusedOCR = OCR(factory, video.frameCount);
+	// every worker can be comparing to a sample stored just before its frame
+	regionCache.init(settings, 2 * threadCount);
+	// a picked frame can be up to the window before its sample
+	order.init(threadCount, picker.isEnabled() ? std::max(0, settings.sharpWindow) : 0);
+	stopAfter = INT_MAX;
+	isInline = threadCount == 1;
+	if (isInline) {
+		// the worker runs to the end here, err is only set if its engines failed to init
 		ThreadStartContext ctx;
 		threadStart(ctx, 0);
-		return true;
+		return !ctx.err;
 	}
 	for (int c = 0; c < threadCount; c++) {
 		ThreadStartContext ctx;
@@ -296,72 +706,200 @@ void ThreadedOCR::stopThreads() {
 }
 
 void ThreadedOCR::threadStart(ThreadStartContext& threadCtx, int idx) {
-	TesseractCTX tessCtx;
+	if (!placement.pinWorker(idx)) {
+		printf("Thread[%d]: Failed to pin, running unpinned\n", idx);
+	}
+	TesseractCTX ownCtx;
 	runningThreads.fetch_add(1);
-	const bool isInit = tessCtx.init(idx);
+	TesseractCTX *tessCtx = engines ? engines->get(idx) : &ownCtx;
+	bool isInit = engines ? tessCtx != nullptr && tessCtx->constrain(constraints) : ownCtx.init(idx, constraints);
+	// first stage of the cascade is always owned by the worker, pooled engines are full recognizers
+	TesseractCTX screener;
+	if (isInit && settings.cascade && !screener.init(idx, constraints, tesseract::OEM_TESSERACT_ONLY)) {
+		printf("Thread[%d]: Failed to init the cascade engine, it needs the legacy model in tessdata\n", idx);
+		isInit = false;
+	}
 	{
+		// notify under the lock, threadCtx is gone as soon as the starting thread sees started
 		lock_guard lock(threadCtx.mtx);
 		threadCtx.started = true;
 		threadCtx.err = !isInit;
+		threadCtx.cvar.notify_one();
 	}
-	threadCtx.cvar.notify_one();
 
 	if (!isInit) {
+		runningThreads.fetch_sub(1);
 		return;
 	}
 
 	OCR ocr(factory, video.frameCount);
+	ocr.upscale = std::max(1, settings.upscale);
 
-	int frameIdx = nextFrame.fetch_add(frameSkip);
+	int frameIdx = 0;
 	ms frameTime;
-	while (frameIdx < maxFrame) {
+	while (true) {
 		if (shouldStop.load()) {
-			return;
+			break;
 		}
 		cv::Mat frame;
 		{
 			lock_guard lock(videoMutex);
-			frame = video.getFrame(frameIdx, frameTime);
-		}
-		ocr.clear();
-		FrameProcessContext ctx {isFirstMatch, settings, tessCtx, frameIdx, matchIndex};
-		ocr.processFrame(ctx, frame, frameTime);
-
-		if (ocr.result.matchType != MatchResult::NoMatch) {
-			const int isHard = (ocr.result.matchType & MatchResult::HardMatch) != 0;
-			const int remaining = remainingMatches.fetch_sub(isHard);
-			if (remaining >= 1) {
-				lock_guard resLock(resultMutex);
-				results.push_back(std::move(ocr.result));
+			int lowestNext = INT_MAX;
+			if (timeSampler.isEnabled()) {
+				// samples only move forward, there is nothing left to report once they pass stopAfter
+				if (!timeSampler.next(video, frame, frameIdx, frameTime) || frameIdx - order.getReach() > stopAfter.load()) {
+					order.setLowestNext(INT_MAX);
+					break;
+				}
+				lowestNext = frameIdx + 1;
+				if (picker.isEnabled() && !picker.pickAhead(video, frame, frameIdx, frameTime)) {
+					frame.release();
+				}
+			} else {
+				if (!sampler.next(frameIdx)) {
+					order.setLowestNext(INT_MAX);
+					break;
+				}
+				const int sampledIdx = frameIdx;
+				if (sampledIdx - order.getReach() > stopAfter.load()) {
+					// adaptive stride can still backfill earlier frames, skip this one without decoding
+					if (!settings.adaptiveStride) {
+						order.setLowestNext(INT_MAX);
+						break;
+					}
+				} else if (picker.isEnabled()) {
+					const bool isPicked = picker.pick(video, frame, frameIdx, frameTime);
+					// stride follows the sampled position, whichever frame was picked
+					sampler.update(sampledIdx, frame);
+					if (!isPicked) {
+						frame.release();
+					}
+				} else {
+					frame = video.getFrame(frameIdx, frameTime);
+					sampler.update(frameIdx, frame);
+				}
+				lowestNext = sampler.lowestNext();
 			}
-			if (remaining == 1) {
-				shouldStop.store(true);
+			if (!frame.empty()) {
+				order.begin(idx, frameIdx);
 			}
+			order.setLowestNext(lowestNext);
 		}
-
-		if (shouldStop.load()) {
-			resultCvar.notify_all();
-			break;
+		if (frame.empty()) {
+			continue;
+		}
+		ocr.clear();
+		FrameProcessContext ctx {settings, *tessCtx, frameIdx, fusion.isEnabled(),
+			settings.cascade ? &screener : nullptr, regionCache.isEnabled() ? &regionCache : nullptr, shouldStop};
+		const TesseractCTX::Status status = ocr.processFrame(ctx, frame, frameTime);
+
+		ResultOrder::Finished done;
+		done.frameIndex = frameIdx;
+		done.timedOut = ocr.timedOut;
+		done.result = std::move(ocr.result);
+		if (fusion.isEnabled() && status == TesseractCTX::Done) {
+			done.frameTime = frameTime;
+			done.frame = frame;
+			done.blocks = std::move(ocr.blocks);
+		}
+		// the collecting thread is behind, wait for it unless stopping
+		while (!order.finish(idx, done) && !shouldStop.load()) {
+			resultCvar.notify_one();
+			std::this_thread::yield();
+		}
+		if (isInline) {
+			collect(false);
+		} else {
+			resultCvar.notify_one();
 		}
-
-		frameIdx = nextFrame.fetch_add(frameSkip);
+	}
+	if (settings.cascade) {
+		lock_guard resLock(resultMutex);
+		cascade.add(ocr.cascade);
 	}
 	const int remaining = runningThreads.fetch_sub(1);
 	if (remaining == 1) {
+		if (settings.verbose && regionCache.isEnabled()) {
+			printf("%d frames recognized only in changed regions, %d blocks reused\n",
+				regionCache.partialFrames.load(), regionCache.reusedBlocks.load());
+			fflush(stdout);
+		}
 		resultCvar.notify_all();
 	}
 }
 
 void ThreadedOCR::waitFinish() {
-	{
+	while (true) {
+		// read before collecting, the workers queued everything before they were done
+		const bool isDone = runningThreads.load() == 0;
+		collect(isDone && !shouldStop.load());
+		if (isDone || shouldStop.load()) {
+			break;
+		}
 		unique_lock lock(resultMutex);
-		resultCvar.wait(lock, [this]() {
-			return remainingMatches == int(results.size()) // all results found
-				|| shouldStop.load() == true // stop flag has been set
-				|| runningThreads.load() == 0; // all threads are done
-		});
+		resultCvar.wait_for(lock, collectInterval);
 	}
 	stopThreads();
+	// frames that were finished while stopping may still complete the earliest results
+	collect(false);
+}
+
+void ThreadedOCR::collect(bool isFinal) {
+	released.clear();
+	const int floor = order.collect(isFinal, released, timedOutFrames);
+	for (ResultOrder::Finished &done : released) {
+		if (fusion.isEnabled()) {
+			fusion.add(done.frameIndex, done.frameTime, done.frame, std::move(done.blocks));
+		} else {
+			release(done.result);
+		}
+	}
+	// a frame is voted on once the samples after it are recognized
+	while (fusion.isEnabled() && remainingMatches.load() > 0 && fusion.next(floor, fused)) {
+		if (fused.frameIndex == -1) {
+			// whatever it matches was already reported at the frames that read it
+			continue;
+		}
+		fusedOCR.matchFused(settings, fused);
+		if (fusedOCR.result.matchType != MatchResult::NoMatch) {
+			fusion.claim(fused.frameIndex);
+			release(fusedOCR.result);
+		}
+	}
+	// the earliest matchLimit hard matches may all be finished while earlier frames are not,
+	// nothing after the last of them is going to be reported
+	const int remaining = remainingMatches.load();
+	if (remaining > 0) {
+		stopAfter.store(std::min(stopAfter.load(), order.findHardMatch(remaining)));
+	}
+}
+
+void ThreadedOCR::release(MatchResult &res) {
+	if (remainingMatches.load() <= 0) {
+		// after the matchLimit-th hard match, not reported
+		return;
+	}
+	const bool isHard = (res.matchType & MatchResult::HardMatch) != 0;
+	const int remaining = remainingMatches.load() - isHard;
+	const char *ruleName = factory.rulebook.ruleName(res.ruleIndices.front());
+	if (!res.frame.empty()) {
+		res.frameHandle = frames.put(res.frame);
+		res.frame.release();
+	}
+	if (isHard) {
+		printf("Match found frame: [%d], [%s]  %d/%d\n", res.frameIndex, ruleName, settings.matchLimit - remaining, settings.matchLimit);
+	} else {
+		printf("Soft match found frame: [%d], [%s]\n", res.frameIndex, ruleName);
+	}
+	fflush(stdout);
+	if (onResult) {
+		onResult(res);
+	}
+	results.push_back(std::move(res));
+	remainingMatches.store(remaining);
+	if (remaining == 0) {
+		shouldStop.store(true);
+	}
 }
 
 bool ThreadedOCR::foundAnyMatches() const {
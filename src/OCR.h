@@ -2,11 +2,23 @@
 
 #include "Utils.h"
 #include "RuleMatcher.h"
+#include "Sampler.h"
+#include "Topology.h"
+#include "FrameStore.h"
+#include "Fusion.h"
+#include "RegionCache.h"
+#include "Mosaic.h"
+#include "Constraints.h"
+#include "SpscQueue.h"
 
 #include <tesseract/baseapi.h>
 #include <opencv2/opencv.hpp>
 
 #include <atomic>
+#include <climits>
+#include <functional>
+#include <map>
+#include <memory>
 #include <thread>
 
 /// Wrapper over cv::VideoCapture to allow easy access
@@ -18,29 +30,78 @@ struct VideoFile {
 
 	ms frameToMs(int index);
 
+	/// Read the next frame in decode order without converting it, frameIndex and frameTime are updated
+	bool grab();
+
+	/// Convert the last grabbed frame
+	bool retrieve(cv::Mat &frame);
+
+	/// Continue grabbing from about this time
+	void seek(ms time);
+
 	~VideoFile();
 
 	cv::VideoCapture video;
-	int frameCount = 0;
+	int frameCount = 0; ///< Estimated by the container, can be off for variable frame rate video
+	int frameIndex = -1; ///< Last grabbed frame, an estimate after a seek
+	ms frameTime = ms(-1); ///< Timestamp of the last grabbed frame, from the decoder
 };
 
 /// Wrapper over TessBaseAPI
 struct TesseractCTX {
+	enum Status {
+		Done,
+		Cancelled, ///< cancel flag was set while recognizing
+		TimedOut, ///< budget ran out, frame has no results
+	};
+
+	/// @param mode OEM_TESSERACT_ONLY for the fast legacy engine that screens regions, needs the legacy model in tessdata
+	bool init(int idx, const RecognizerConstraints &constraints = RecognizerConstraints(),
+		tesseract::OcrEngineMode mode = tesseract::OEM_TESSERACT_LSTM_COMBINED);
+
+	/// Reinitialize the engine if it was built for different constraints
+	bool constrain(const RecognizerConstraints &constraints);
 
-	bool init(int idx);
+	~TesseractCTX();
 
-	void orcImage(const cv::Mat &frame);
+	/// 8 bit gray image that is handed to Tesseract as is, preprocessing writes its final result here
+	/// The returned Mat is a header over the engine's Pix and is valid until the next call
+	cv::Mat getImageBuffer(int width, int height);
+
+	/// Recognize the image in the buffer, returns early as soon as cancel is set or after budgetMs
+	/// @param cancel polled by Tesseract between words, can be null
+	/// @param budgetMs time limit for the frame, 0 for none
+	Status orcImage(const std::atomic<bool> *cancel = nullptr, int budgetMs = 0);
 
 	int index = 0;
 	tesseract::TessBaseAPI tesseract;
+	Pix *image = nullptr; ///< Reused between frames, reallocated only when the size changes
+	uint64_t constraintsChecksum = 0; ///< RecognizerConstraints the engine was initialized with
+	tesseract::OcrEngineMode mode = tesseract::OEM_TESSERACT_LSTM_COMBINED;
+};
+
+/// Recognition engines that stay initialized between runs
+struct EnginePool {
+	bool init(int count);
+
+	/// @return nullptr if idx is out of range
+	TesseractCTX *get(int idx);
+
+	int size() const {
+		return int(engines.size());
+	}
+
+	std::vector<std::unique_ptr<TesseractCTX>> engines;
 };
 
 struct FrameProcessContext {
-	std::atomic<bool> &isFirstMatch;
 	const Settings &settings;
 	TesseractCTX &recognizer;
 	int frameIndex;
-	std::atomic<int> &matchIndex;
+	bool isFused; ///< Blocks are matched later, after the neighbouring samples voted on them
+	TesseractCTX *screener; ///< First stage of the cascade, nullptr if every region goes to the recognizer
+	RegionCache *regionCache; ///< Shared by all workers, nullptr if frames are recognized whole
+	const std::atomic<bool> &shouldStop; ///< Abandons recognition of the frame when set
 };
 
 struct MatchResult {
@@ -50,11 +111,29 @@ struct MatchResult {
 		HardMatch = 1 << 1,
 	};
 
-	std::vector<int> whitelistIndices;
-	cv::Mat frame;
+	std::vector<int> ruleIndices; ///< Matched whitelist rules, ids in the Rulebook
+	HitList hits; ///< Term hits of the matched rules only
+	int frameHandle = -1; ///< Annotated frame of a released hard match in ThreadedOCR::frames
+	cv::Mat frame; ///< Annotated frame of a hard match until the result is released, then moved to ThreadedOCR::frames
 	MatchType matchType = NoMatch;
 	int frameIndex = -1;
-	RuleSet ruleSet;
+	ms frameTime = ms(0);
+};
+
+/// Counters of the recognition cascade, a cheap first stage reads the regions at low scale
+/// and only lines that may contain a term are recognized again by the full engine
+struct CascadeStats {
+	int screenedLines = 0; ///< Lines read by the first stage
+	int escalatedLines = 0; ///< Lines that may contain a term
+	int escalatedRegions = 0; ///< Regions sent to the full engine, touching lines are joined
+	int confirmedRegions = 0; ///< Escalated regions where the full engine found a term
+
+	void add(const CascadeStats &other) {
+		screenedLines += other.screenedLines;
+		escalatedLines += other.escalatedLines;
+		escalatedRegions += other.escalatedRegions;
+		confirmedRegions += other.confirmedRegions;
+	}
 };
 
 struct OCR {
@@ -64,15 +143,119 @@ struct OCR {
 
 	OCR(const MatcherFactory &factory, int totalFrames = -1);
 
-	void processFrame(FrameProcessContext &ctx, const cv::Mat &frameData, ms frameTime);
+	/// Recognize the frame and match the rules on it, unless it is fused
+	/// @return Done if the blocks are valid
+	TesseractCTX::Status processFrame(FrameProcessContext &ctx, const cv::Mat &frameData, ms frameTime);
+
+	/// Match the rules on the voted readings of a sample, the result is at its best frame
+	void matchFused(const Settings &settings, const FusedFrame &fused);
+
 	void clear();
 
-	cv::Mat preprocessFrame(const Settings &settings, cv::Mat input) const;
+	/// Recognize the frame into blocks
+	/// @return the blocks are valid only if Done
+	TesseractCTX::Status recognizeBlocks(FrameProcessContext &ctx, const cv::Mat &sourceFrame);
+
+	/// Recognize one region of the frame and add its blocks in source frame coordinates
+	TesseractCTX::Status recognizeRegion(FrameProcessContext &ctx, const cv::Mat &sourceFrame, const cv::Rect &region, int budgetMs);
+
+	/// Read one region with the cascade's first stage and add the lines that may contain a term to candidates
+	TesseractCTX::Status screenRegion(FrameProcessContext &ctx, const cv::Mat &sourceFrame, const cv::Rect &region, int budgetMs);
+
+	/// Lay out the text found in regions as a mosaic
+	/// @return false if the regions are better recognized directly
+	bool planMosaic(const cv::Mat &sourceFrame);
+
+	/// Recognize the planned mosaic in one pass and add its blocks in source frame coordinates
+	TesseractCTX::Status recognizeMosaic(FrameProcessContext &ctx, const cv::Mat &sourceFrame, int budgetMs);
+
+	/// Prepare the image for recognition in the recognizer's image buffer
+	/// @return header over the buffer, scaled by upscale
+	cv::Mat preprocessFrame(const cv::Mat &input, TesseractCTX &recognizer);
+
+	/// Scale an 8 bit gray image into the recognizer's image buffer
+	cv::Mat toImageBuffer(const cv::Mat &image, TesseractCTX &recognizer, int scale);
+
 
 	int totalFrames = -1;
+	int upscale = 4; ///< Small text is only recognized in zoomed in images, Settings::upscale
 	RuleSet ruleSet;
+	BlockList blocks; ///< Blocks of the current frame
 
 	MatchResult result;
+	bool timedOut = false; ///< Current frame ran over Settings::frameBudgetMs and was not matched
+	CascadeStats cascade; ///< Totals over all frames of this worker
+
+private:
+	/// Match the rules on the blocks added to ruleSet and keep the annotated frame of a hard match on the result
+	void matchRules(const Settings &settings, const cv::Mat &sourceFrame);
+
+	std::vector<cv::Rect> regions; ///< Parts of the current frame to recognize
+	cv::Mat regionThumb; ///< Current frame as compared by the RegionCache
+	std::vector<cv::Rect> candidates; ///< Lines of the current frame the cascade escalates
+	cv::Mat gray;
+	MosaicBatcher mosaic;
+	std::vector<cv::Rect> textRegions;
+	cv::Mat mosaicImage;
+	std::vector<int> matchedRules;
+};
+
+/// Puts the results of the workers back in frame order without a lock between them.
+/// Each worker hands its finished frames to its own lock free queue and publishes the frame it is processing,
+/// the sampling side publishes the lowest frame it can still sample. The collecting thread releases a result
+/// only when no earlier frame is still processed or can still be sampled, whichever worker finishes first.
+struct ResultOrder {
+	/// Frame a worker is done with, queued if it has a result, ran over the budget or is fused later
+	struct Finished {
+		MatchResult result;
+		int frameIndex = -1; ///< Processed frame, also the frame of the result
+		bool timedOut = false;
+		ms frameTime = ms(0);
+		cv::Mat frame; ///< Only for fusion
+		BlockList blocks; ///< Only for fusion
+	};
+
+	/// @param reach how many frames before its own a processed frame can report a result at
+	void init(int workerCount, int reach);
+
+	/// Worker starts processing frameIndex, called under the video lock before setLowestNext
+	void begin(int worker, int frameIndex);
+
+	/// Worker is done with its frame, moved from if it is queued
+	/// @return false if the queue is full, nothing changed
+	bool finish(int worker, Finished &done);
+
+	/// Lowest frame the sampler can still return, called under the video lock after each sample
+	void setLowestNext(int frameIndex);
+
+	/// Move the finished frames no other can come before to released, in frame order. Called by one thread at a time.
+	/// @param isFinal all workers are done, release everything that is left
+	/// @return every frame before this one is released, INT_MAX if isFinal
+	int collect(bool isFinal, std::vector<Finished> &released, std::vector<int> &timedOut);
+
+	/// Frame of the count-th earliest hard match that is finished but not released yet
+	/// @return INT_MAX if there are fewer
+	int findHardMatch(int count) const;
+
+	int getReach() const {
+		return reach;
+	}
+
+private:
+	struct Worker {
+		explicit Worker(int capacity)
+			: queue(capacity)
+		{}
+
+		SpscQueue<Finished> queue;
+		std::atomic<int> current = INT_MAX; ///< Frame being processed, INT_MAX between frames
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::atomic<int> lowestNext = INT_MIN;
+	int reach = 0;
+	std::multimap<int, Finished> pending; ///< Finished frames by frame, only used by the collecting thread
+	Finished finished;
 };
 
 struct ThreadedOCR {
@@ -90,30 +273,55 @@ struct ThreadedOCR {
 
 	void threadStart(ThreadStartContext &threadCtx, int idx);
 
+	/// Collect results in frame order until all are found or the workers are done
 	void waitFinish();
 
+	/// Release the results that are certain to be next, stop the workers at the matchLimit-th hard match
+	/// @param isFinal all workers are done
+	void collect(bool isFinal);
+
+	/// Report a result in frame order, unless it is after the matchLimit-th hard match
+	void release(MatchResult &result);
+
 	bool foundAnyMatches() const;
 
+	int sampledCount() const {
+		return timeSampler.isEnabled() ? timeSampler.sampledCount : sampler.sampledCount;
+	}
+
 	const Settings settings;
 	const MatcherFactory &factory;
 	VideoFile &video;
 	std::mutex videoMutex;
 
-	std::vector<MatchResult> results;
-	std::atomic<int> remainingMatches = 1;
-	std::condition_variable resultCvar;
+	std::vector<MatchResult> results; ///< In frame order, up to the matchLimit-th hard match, written by the collecting thread
+	std::vector<int> timedOutFrames; ///< Frames that ran over the budget, written by the collecting thread
+	std::atomic<int> remainingMatches = 1; ///< Hard matches still to release
+	std::atomic<int> stopAfter = INT_MAX; ///< Frames after this one can not be reported any more and are not processed
+	ResultOrder order;
+	bool isInline = false; ///< Single worker runs on the calling thread and collects its own results
+	std::vector<ResultOrder::Finished> released; ///< Frames of one collect() call, only used by the collecting thread
+	OCR fusedOCR; ///< Matches the voted readings of fused frames, only used by the collecting thread
+	FusedFrame fused;
+	std::condition_variable resultCvar; ///< Wakes the collecting thread, notified without the lock
 	std::mutex resultMutex;
 
 	std::atomic<bool> shouldStop = false;
 	std::atomic<int> runningThreads = 0;
-	std::atomic<int> nextFrame = 0;
 
 	// for FrameProcessContext
-	std::atomic<bool> isFirstMatch = true;
-	std::atomic<int> matchIndex = 0;
-
-	int maxFrame;
-	const int frameSkip = 24;
+	FrameStore frames;
+	FusionWindow fusion; ///< Only used by the collecting thread
+	RegionCache regionCache; ///< Shared by the workers
+
+	FrameSampler sampler; ///< Guarded by videoMutex
+	TimeSampler timeSampler; ///< Used instead of sampler if enabled, guarded by videoMutex
+	SharpnessPicker picker; ///< Replaces samples by the sharpest frame near them if enabled, guarded by videoMutex
+	PlacementPlan placement;
+	EnginePool *engines = nullptr; ///< Use already initialized engines instead of one per thread
+	RecognizerConstraints constraints; ///< Built from the rules if Settings::ruleConstraints
+	CascadeStats cascade; ///< Totals of all workers, guarded by resultMutex
+	std::function<void(const MatchResult &)> onResult; ///< Called for each kept result in frame order, by the collecting thread
 
 	std::vector<std::thread> threads;
 };
\ No newline at end of file
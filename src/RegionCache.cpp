@@ -0,0 +1,128 @@
+#include "RegionCache.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+/// Frames are compared at 1/4 of the source resolution
+static const int thumbScale = 4;
+/// Percent of tile pixels that must change for the tile to be recognized again
+static const float tileChange = 2.f;
+/// Above this percent of the frame in dirty regions the whole frame is recognized in one pass
+static const float maxDirtyArea = 60.f;
+
+/// Overlapping or adjacent, text crossing the border of two changed tiles must not be cut in half
+static bool isTouching(const cv::Rect &a, const cv::Rect &b) {
+	const cv::Rect grown{a.x - 1, a.y - 1, a.width + 2, a.height + 2};
+	return (grown & b).area() > 0;
+}
+
+void RegionCache::init(const Settings &settings, int capacity) {
+	tileSize = settings.regionTile > 0 ? std::max(settings.regionTile, thumbScale * 4) : 0;
+	this->capacity = std::max(1, capacity);
+	reusedBlocks = 0;
+	partialFrames = 0;
+	lock_guard lock(mutex);
+	samples.clear();
+}
+
+void RegionCache::plan(int frameIndex, const cv::Mat &frame, cv::Mat &thumb, BlockList &kept, std::vector<cv::Rect> &dirty) {
+	dirty.clear();
+	const cv::Rect whole{{0, 0}, frame.size()};
+
+	cv::Mat diff;
+	cv::resize(frame, diff, {}, 1. / thumbScale, 1. / thumbScale, cv::INTER_AREA);
+	// the last thumb is shared with the stored sample, do not write over it
+	thumb = cv::Mat();
+	cv::cvtColor(diff, thumb, cv::COLOR_BGR2GRAY);
+
+	std::shared_ptr<const Sample> last;
+	{
+		lock_guard lock(mutex);
+		auto next = samples.lower_bound(frameIndex);
+		if (next != samples.begin()) {
+			last = std::prev(next)->second;
+		}
+	}
+	if (!last || frame.size() != last->frameSize || thumb.size() != last->thumb.size()) {
+		dirty.push_back(whole);
+		return;
+	}
+	const BlockList &blocks = last->blocks;
+
+	cv::absdiff(thumb, last->thumb, diff);
+	cv::threshold(diff, diff, 16., 255., cv::THRESH_BINARY);
+	const int thumbTile = tileSize / thumbScale;
+	for (int y = 0; y < diff.rows; y += thumbTile) {
+		for (int x = 0; x < diff.cols; x += thumbTile) {
+			const cv::Rect tile = cv::Rect{x, y, thumbTile, thumbTile} & cv::Rect{{0, 0}, diff.size()};
+			if (cv::countNonZero(diff(tile)) * 100.f > tileChange * float(tile.area())) {
+				const cv::Rect region{tile.x * thumbScale, tile.y * thumbScale, tile.width * thumbScale, tile.height * thumbScale};
+				dirty.push_back(region & whole);
+			}
+		}
+	}
+
+	// a block touching a changed tile is recognized again as a whole, growing a region can make it
+	// touch other blocks or regions so repeat until nothing changes
+	std::vector<bool> isDirty(blocks.size(), false);
+	bool hasGrown = true;
+	while (hasGrown) {
+		hasGrown = false;
+		for (int c = 0; c < int(dirty.size()); c++) {
+			for (int r = c + 1; r < int(dirty.size()); r++) {
+				if (isTouching(dirty[c], dirty[r])) {
+					dirty[c] |= dirty[r];
+					dirty.erase(dirty.begin() + r);
+					r = c;
+					hasGrown = true;
+				}
+			}
+		}
+		for (int c = 0; c < int(blocks.size()); c++) {
+			if (isDirty[c]) {
+				continue;
+			}
+			for (cv::Rect &region : dirty) {
+				if ((region & blocks[c].bbox).area() > 0) {
+					region |= blocks[c].bbox;
+					region &= whole;
+					isDirty[c] = true;
+					hasGrown = true;
+					break;
+				}
+			}
+		}
+	}
+
+	int dirtyArea = 0;
+	for (const cv::Rect &region : dirty) {
+		dirtyArea += region.area();
+	}
+	if (dirtyArea * 100.f > maxDirtyArea * float(whole.area())) {
+		dirty.assign(1, whole);
+		return;
+	}
+
+	for (int c = 0; c < int(blocks.size()); c++) {
+		if (!isDirty[c]) {
+			kept.push_back(blocks[c].copy());
+			++reusedBlocks;
+		}
+	}
+	++partialFrames;
+}
+
+void RegionCache::store(int frameIndex, const cv::Size &frameSize, const cv::Mat &thumb, const BlockList &frameBlocks) {
+	auto sample = std::make_shared<Sample>();
+	sample->frameSize = frameSize;
+	sample->thumb = thumb;
+	for (const TextBlock &block : frameBlocks) {
+		sample->blocks.push_back(block.copy());
+	}
+
+	lock_guard lock(mutex);
+	samples[frameIndex] = std::move(sample);
+	// the earliest samples are the least likely to be the latest before a frame still to process
+	while (int(samples.size()) > capacity) {
+		samples.erase(samples.begin());
+	}
+}
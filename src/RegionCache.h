@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Utils.h"
+#include "RuleMatcher.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// Text blocks of the last recognized samples, so only the parts of a frame that changed are recognized again.
+/// The frame is compared to the cached one tile by tile, cached blocks that do not touch a changed tile are reused
+/// and the changed tiles, grown to fully cover every cached block they touch, are recognized again.
+/// One cache is shared by all workers and keyed by frame, a frame is compared to the latest stored sample before it,
+/// whichever worker recognized that one.
+struct RegionCache {
+	/// @param capacity samples to keep, enough for the frames all workers are processing
+	void init(const Settings &settings, int capacity);
+
+	bool isEnabled() const {
+		return tileSize > 0;
+	}
+
+	/// Compare the frame to the latest stored sample before it, safe to call from any worker
+	/// @param thumb receives the reduced frame, passed back to store()
+	/// @param kept receives the cached blocks that are still valid in this frame
+	/// @param dirty receives the regions to recognize, in source frame coordinates
+	void plan(int frameIndex, const cv::Mat &frame, cv::Mat &thumb, BlockList &kept, std::vector<cv::Rect> &dirty);
+
+	/// Remember the blocks of a frame after its dirty regions were recognized, frames that failed are not stored
+	void store(int frameIndex, const cv::Size &frameSize, const cv::Mat &thumb, const BlockList &frameBlocks);
+
+	std::atomic<int> reusedBlocks = 0; ///< Cached blocks used instead of recognizing them again
+	std::atomic<int> partialFrames = 0; ///< Frames where only changed regions were recognized
+private:
+	struct Sample {
+		cv::Size frameSize;
+		cv::Mat thumb;
+		BlockList blocks;
+	};
+
+	int tileSize = 0; ///< In source frame pixels, 0 disables the cache
+	int capacity = 1;
+	std::mutex mutex;
+	std::map<int, std::shared_ptr<const Sample>> samples; ///< By frame, guarded by mutex
+};
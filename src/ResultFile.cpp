@@ -0,0 +1,184 @@
+#include "ResultFile.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+static const char *partialMagic = "legendary-waffle-partial";
+static const int partialVersion = 2;
+
+bool PartialResults::write(const std::string &path) const {
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file) {
+		return false;
+	}
+	fprintf(file, "%s %d\n", partialMagic, partialVersion);
+	fprintf(file, "video %s\n", videoPath.c_str());
+	fprintf(file, "frames %d\n", frameCount);
+	fprintf(file, "range %d %d %d %d\n", fromFrame, toFrame, matchLimit, int(stoppedAtLimit));
+	fprintf(file, "rules %016" PRIx64 "\n", rulesChecksum);
+	fprintf(file, "results %d\n", int(results.size()));
+	for (const MatchResult &res : results) {
+		fprintf(file, "result %d %lld %d %d %d\n", res.frameIndex, (long long)res.frameTime.count(), int(res.matchType),
+			int(res.ruleIndices.size()), int(res.hits.size()));
+		for (int rule : res.ruleIndices) {
+			fprintf(file, "%d\n", rule);
+		}
+		for (const TermHit &hit : res.hits) {
+			fprintf(file, "%d %d %d %d %d %d %d\n", hit.rule, hit.term, int(hit.variant), hit.bbox.x, hit.bbox.y, hit.bbox.width, hit.bbox.height);
+		}
+	}
+	const bool isWritten = ferror(file) == 0;
+	return fclose(file) == 0 && isWritten;
+}
+
+bool PartialResults::read(const std::string &path) {
+	FILE *file = fopen(path.c_str(), "r");
+	if (!file) {
+		return false;
+	}
+	results.clear();
+
+	auto readAll = [&]() {
+		char magic[64] = {0,};
+		int version = 0;
+		if (fscanf(file, "%63s %d ", magic, &version) != 2 || partialMagic != std::string(magic) || version != partialVersion) {
+			return false;
+		}
+		char line[4096] = {0,};
+		if (!fgets(line, sizeof(line), file) || strncmp(line, "video ", 6) != 0) {
+			return false;
+		}
+		videoPath = line + 6;
+		while (!videoPath.empty() && (videoPath.back() == '\n' || videoPath.back() == '\r')) {
+			videoPath.pop_back();
+		}
+
+		int stopped = 0, count = 0;
+		if (fscanf(file, "frames %d ", &frameCount) != 1
+			|| fscanf(file, "range %d %d %d %d ", &fromFrame, &toFrame, &matchLimit, &stopped) != 4
+			|| fscanf(file, "rules %" SCNx64 " ", &rulesChecksum) != 1
+			|| fscanf(file, "results %d ", &count) != 1 || count < 0) {
+			return false;
+		}
+		stoppedAtLimit = stopped != 0;
+
+		results.resize(count);
+		for (MatchResult &res : results) {
+			long long timeMs = 0;
+			int type = 0, ruleCount = 0, hitCount = 0;
+			if (fscanf(file, "result %d %lld %d %d %d ", &res.frameIndex, &timeMs, &type, &ruleCount, &hitCount) != 5
+				|| ruleCount < 0 || hitCount < 0) {
+				return false;
+			}
+			res.frameTime = ms(timeMs);
+			res.matchType = MatchResult::MatchType(type);
+			res.ruleIndices.resize(ruleCount);
+			for (int &rule : res.ruleIndices) {
+				if (fscanf(file, "%d ", &rule) != 1) {
+					return false;
+				}
+			}
+			res.hits.resize(hitCount);
+			for (TermHit &hit : res.hits) {
+				int variant = 0;
+				if (fscanf(file, "%d %d %d %d %d %d %d ", &hit.rule, &hit.term, &variant, &hit.bbox.x, &hit.bbox.y, &hit.bbox.width, &hit.bbox.height) != 7) {
+					return false;
+				}
+				hit.variant = TermHit::Variant(variant);
+			}
+		}
+		return true;
+	};
+
+	const bool isRead = readAll();
+	fclose(file);
+	return isRead;
+}
+
+void orderResults(std::vector<MatchResult> &results, int matchLimit) {
+	std::stable_sort(results.begin(), results.end(), [](const MatchResult &a, const MatchResult &b) {
+		return a.frameIndex < b.frameIndex;
+	});
+
+	int hardMatches = 0;
+	for (int c = 0; c < int(results.size()); c++) {
+		if (hardMatches == matchLimit) {
+			// nothing after the last needed match would have been reported
+			results.resize(c);
+			break;
+		}
+		if (results[c].matchType & MatchResult::HardMatch) {
+			++hardMatches;
+		}
+	}
+}
+
+/// Check that all rule and term ids of a shard exist in the rulebook, files are not trusted to match it
+static bool isInRulebook(const PartialResults &shard, const Rulebook &rulebook) {
+	const int ruleCount = rulebook.rules.size();
+	const int termCount = rulebook.terms.size();
+	for (const MatchResult &res : shard.results) {
+		for (int rule : res.ruleIndices) {
+			if (rule < 0 || rule >= ruleCount) {
+				return false;
+			}
+		}
+		for (const TermHit &hit : res.hits) {
+			if (hit.rule < 0 || hit.rule >= ruleCount || hit.term < 0 || hit.term >= termCount || hit.variant > TermHit::NoLast) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool mergeResults(const std::vector<PartialResults> &shards, const Rulebook &rulebook, int matchLimit, std::vector<MatchResult> &merged) {
+	merged.clear();
+	const uint64_t checksum = rulebook.checksum();
+	for (const PartialResults &shard : shards) {
+		if (shard.rulesChecksum != checksum) {
+			printf("Shard [%d, %d) was made with different rules\n", shard.fromFrame, shard.toFrame);
+			return false;
+		}
+		if (!isInRulebook(shard, rulebook)) {
+			printf("Shard [%d, %d) has rule or term ids that are not in the rules\n", shard.fromFrame, shard.toFrame);
+			return false;
+		}
+		// shards may run on machines that mount the video at different paths, the frame count tells videos apart
+		if (shard.frameCount != shards.front().frameCount) {
+			printf("Shard [%d, %d) is for a different video %s with %d frames\n", shard.fromFrame, shard.toFrame, shard.videoPath.c_str(), shard.frameCount);
+			return false;
+		}
+		const fs::path name = fs::path(shard.videoPath).filename();
+		if (name != fs::path(shards.front().videoPath).filename()) {
+			printf("Warning: shard [%d, %d) is for %s, merging it since it has the same frame count\n", shard.fromFrame, shard.toFrame, shard.videoPath.c_str());
+		}
+		if (shard.matchLimit < matchLimit && shard.stoppedAtLimit) {
+			// it may have skipped matches that are needed now
+			printf("Shard [%d, %d) stopped at %d matches, fewer than %d\n", shard.fromFrame, shard.toFrame, shard.matchLimit, matchLimit);
+			return false;
+		}
+		merged.insert(merged.end(), shard.results.begin(), shard.results.end());
+	}
+
+	std::vector<const PartialResults *> byRange;
+	for (const PartialResults &shard : shards) {
+		byRange.push_back(&shard);
+	}
+	std::sort(byRange.begin(), byRange.end(), [](const PartialResults *a, const PartialResults *b) {
+		return a->fromFrame < b->fromFrame;
+	});
+	for (int c = 1; c < int(byRange.size()); c++) {
+		if (byRange[c - 1]->toFrame != byRange[c]->fromFrame) {
+			printf("Warning: shards [%d, %d) and [%d, %d) are not adjacent\n",
+				byRange[c - 1]->fromFrame, byRange[c - 1]->toFrame, byRange[c]->fromFrame, byRange[c]->toFrame);
+		}
+	}
+
+	orderResults(merged, matchLimit);
+	return true;
+}
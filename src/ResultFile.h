@@ -0,0 +1,29 @@
+#pragma once
+
+#include "OCR.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Results of one shard of a video, written with -partialOut and combined with -merge
+struct PartialResults {
+	bool write(const std::string &path) const;
+	bool read(const std::string &path);
+
+	std::string videoPath; ///< As given on the command line of the shard, may differ between machines
+	int frameCount = 0; ///< Frames of the whole video, shards of the same video agree on it
+	int fromFrame = 0;
+	int toFrame = 0;
+	int matchLimit = 1;
+	bool stoppedAtLimit = false; ///< Shard reached matchLimit before the end of its range
+	uint64_t rulesChecksum = 0; ///< All shards must use the same rules for rule and term ids to match
+	std::vector<MatchResult> results;
+};
+
+/// Order results by frame and cut them after the matchLimit-th hard match, like a single run would report them
+void orderResults(std::vector<MatchResult> &results, int matchLimit);
+
+/// Combine shard results into the results of a single run over the whole video
+/// @return false if shards do not match each other or the rules, or refer to rules and terms the rulebook does not have
+bool mergeResults(const std::vector<PartialResults> &shards, const Rulebook &rulebook, int matchLimit, std::vector<MatchResult> &merged);
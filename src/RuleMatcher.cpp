@@ -1,8 +1,25 @@
 #include "RuleMatcher.h"
+#include "TextNormalize.h"
 
 #include <fstream>
 #include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <type_traits>
+#include <unordered_map>
 
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef WITH_EDIT_DISTANCE
 static int getEditDistance(const char *word1, int len1, const char *word2, int len2) {
 	typedef std::vector<int> IntArr;
 	typedef std::vector<IntArr> Table;
@@ -42,12 +59,13 @@ static int getEditDistance(const char *word1, int len1, const char *word2, int l
 	}
 	return matrix[len1][len2];
 }
+#endif
 
 
 CharPtrView::CharPtrView(CharPtr &&ptr): ptr(std::move(ptr)) {
-	assert(ptr);
-	if (ptr) {
-		length = int(strlen(ptr.get()));
+	assert(this->ptr);
+	if (this->ptr) {
+		length = int(strlen(this->ptr.get()));
 	}
 }
 
@@ -55,146 +73,782 @@ CharPtrView::CharPtrView(CharPtr&& ptr, int length): ptr(std::move(ptr)), length
 	assert(this->ptr.get());
 }
 
-RuleMatcher::RuleMatcher(const Descriptor &descriptor)
-	: descriptorPtr(&descriptor)
-	, used(descriptor.words.size(), false)
+TextBlock TextBlock::copy() const {
+	CharPtr data(new char[text.size() + 1]);
+	memcpy(data.get(), text.get(), text.size());
+	data[text.size()] = 0;
+	return TextBlock{CharPtrView(std::move(data), text.size()), bbox, confidence};
+}
+
+bool SpatialConstraint::isInside(const cv::Rect &bbox, const cv::Size &frameSize) const {
+	if (!hasRegion || frameSize.area() == 0) {
+		return true;
+	}
+	const float x = (bbox.x + bbox.width * 0.5f) / frameSize.width;
+	const float y = (bbox.y + bbox.height * 0.5f) / frameSize.height;
+	return x >= region[0] && x < region[0] + region[2] && y >= region[1] && y < region[1] + region[3];
+}
+
+bool SpatialConstraint::isGrouped(const cv::Rect &a, const cv::Rect &b) const {
+	if (grouping == SameLine) {
+		const int overlap = std::min(a.y + a.height, b.y + b.height) - std::max(a.y, b.y);
+		return overlap * 2 >= std::min(a.height, b.height);
+	}
+	if (grouping == Near) {
+		const int dx = std::max(0, std::max(a.x, b.x) - std::min(a.x + a.width, b.x + b.width));
+		const int dy = std::max(0, std::max(a.y, b.y) - std::min(a.y + a.height, b.y + b.height));
+		return int64_t(dx) * dx + int64_t(dy) * dy <= int64_t(distance) * distance;
+	}
+	return true;
+}
+
+/// Smallest cell of the spatial hash, keeps the number of cells of a large block low
+static const int minCellSize = 32;
+/// Height of a cell for same line grouping, cells span the whole frame width
+static const int lineBand = 16;
+
+RuleSet::RuleSet(const Rulebook &rulebook)
+	: book(&rulebook)
+	, used((rulebook.ruleTerms.size() + 63) / 64, 0)
+	, found(rulebook.rules.size(), 0)
+	, termStamp(rulebook.terms.size(), 0)
+	, termResult(rulebook.terms.size(), -1)
+	, ruleStamp(rulebook.rules.size(), 0)
+	, blockCount(rulebook.rules.size(), 0)
+	, groupFound(rulebook.rules.size(), 0)
 {}
 
-void RuleMatcher::addBlock(const CharPtrView &data, const cv::Rect &where) {
-	assert(descriptorPtr);
-	if (!descriptorPtr) {
+void RuleSet::addBlock(const CharPtrView& data, const cv::Rect& where) {
+	assert(book);
+	if (!book) {
 		return;
 	}
-	
-	for (int c = 0; c < descriptorPtr->words.size(); c++) {
-		const std::string &keyWord = descriptorPtr->words[c];
-		if (used[c]) {
-			continue;
+	++blockStamp;
+	blockTerms.clear();
+
+#ifdef WITH_EDIT_DISTANCE
+	// fuzzy matches are not found through exact trigrams
+	for (int term = 0; term < book->terms.size(); term++) {
+		matchTerm(term, data);
+	}
+#else
+	for (int term : book->shortTerms) {
+		matchTerm(term, data);
+	}
+	for (int c = 0; c + 3 <= data.size(); c++) {
+		const int bucket = book->trigramBucket(data.get() + c);
+		for (int idx = book->bucketStart[bucket]; idx < book->bucketStart[bucket + 1]; idx++) {
+			matchTerm(book->bucketTerms[idx], data);
 		}
+	}
+#endif
+	for (int term : blockTerms) {
+		for (int idx = book->termSlotStart[term]; idx < book->termSlotStart[term + 1]; idx++) {
+			const int rule = book->slotRules[book->termSlots[idx]];
+			const Rulebook::Rule &desc = book->rules[rule];
+			if (!desc.isBlackList || !desc.spatial.isInside(where, frameSize)) {
+				continue;
+			}
+			if (ruleStamp[rule] != blockStamp) {
+				ruleStamp[rule] = blockStamp;
+				blockCount[rule] = 0;
+			}
+			if (++blockCount[rule] >= desc.required) {
+				return;
+			}
+		}
+	}
 
-		TermMatch match;
-		if (tryMatchWord(data, keyWord, match)) {
-			match.bbox = where;
-			matches.push_back(match);
-			++found;
-			used[c] = true;
+	blockSlots.clear();
+	for (int term : blockTerms) {
+		for (int idx = book->termSlotStart[term]; idx < book->termSlotStart[term + 1]; idx++) {
+			const int slot = book->termSlots[idx];
+			const Rulebook::Rule &desc = book->rules[book->slotRules[slot]];
+			if (desc.isBlackList || !desc.spatial.isInside(where, frameSize)) {
+				continue;
+			}
+			// grouping rules need every place a term was found, not just the first one
+			if (desc.spatial.grouping != SpatialConstraint::Anywhere || !(used[slot >> 6] & (uint64_t(1) << (slot & 63)))) {
+				blockSlots.push_back(slot);
+			}
+		}
+	}
+	// slots are ordered by rule, hits come out in the same order as matching rule by rule
+	std::sort(blockSlots.begin(), blockSlots.end());
+	for (int slot : blockSlots) {
+		const int rule = book->slotRules[slot];
+		const int term = book->ruleTerms[slot];
+		hits.push_back({rule, term, TermHit::Variant(termResult[term]), where});
+		if (found[rule]++ == 0) {
+			touchedRules.push_back(rule);
 		}
+		if (book->rules[rule].spatial.grouping != SpatialConstraint::Anywhere) {
+			spatialHits.push_back({rule, slot, where});
+			continue;
+		}
+		used[slot >> 6] |= uint64_t(1) << (slot & 63);
+		usedSlots.push_back(slot);
+	}
+}
+
+/// Key of a grid cell of a rule, coordinates are at most 20 bits
+static uint64_t cellKey(int rule, int x, int y) {
+	return uint64_t(rule) << 40 | uint64_t(y & 0xFFFFF) << 20 | uint64_t(x & 0xFFFFF);
+}
 
+void RuleSet::getCells(const SpatialHit &hit, int margin, cv::Rect &cells) const {
+	const SpatialConstraint &spatial = book->rules[hit.rule].spatial;
+	if (spatial.grouping == SpatialConstraint::SameLine) {
+		cells.x = 0;
+		cells.width = 1;
+		cells.y = std::max(0, hit.bbox.y) / lineBand;
+		cells.height = std::max(0, hit.bbox.y + hit.bbox.height - 1) / lineBand - cells.y + 1;
+		return;
 	}
+	const int size = std::max(minCellSize, spatial.distance);
+	const int left = std::max(0, hit.bbox.x - margin) / size;
+	const int top = std::max(0, hit.bbox.y - margin) / size;
+	cells = cv::Rect{left, top,
+		std::max(0, hit.bbox.x + hit.bbox.width + margin - 1) / size - left + 1,
+		std::max(0, hit.bbox.y + hit.bbox.height + margin - 1) / size - top + 1};
 }
 
-bool RuleMatcher::isFullMatch(const CharPtrView &data, const cv::Rect &) {
-	assert(descriptorPtr);
-	if (!descriptorPtr) {
-		return false;
+void RuleSet::finishFrame() {
+	if (spatialHits.empty()) {
+		return;
+	}
+	if (slotStamp.empty()) {
+		slotStamp.assign(book->ruleTerms.size(), 0);
 	}
 
-	TermMatch m;
-	int count = 0;
-	std::fill(used.begin(), used.end(), false);
-	for (int c = 0; c < int(descriptorPtr->words.size()); c++) {
-		if (used[c]) {
-			continue;;
+	// built once per frame, every hit is filed under the cells its block covers
+	grid.clear();
+	cv::Rect cells;
+	for (int c = 0; c < int(spatialHits.size()); c++) {
+		getCells(spatialHits[c], 0, cells);
+		for (int y = cells.y; y < cells.y + cells.height; y++) {
+			for (int x = cells.x; x < cells.x + cells.width; x++) {
+				grid.push_back({cellKey(spatialHits[c].rule, x, y), c});
+			}
+		}
+	}
+	std::sort(grid.begin(), grid.end());
+
+	// a rule matches if enough of its terms are grouped with one of its hits
+	for (const SpatialHit &anchor : spatialHits) {
+		const Rulebook::Rule &desc = book->rules[anchor.rule];
+		if (groupFound[anchor.rule]) {
+			continue;
 		}
-		if (tryMatchWord(data, descriptorPtr->words[c], m)) {
-			used[c] = true;
-			++count;
+		++groupStamp;
+		int count = 0;
+		getCells(anchor, desc.spatial.grouping == SpatialConstraint::Near ? desc.spatial.distance : 0, cells);
+		for (int y = cells.y; y < cells.y + cells.height && count < desc.required; y++) {
+			for (int x = cells.x; x < cells.x + cells.width && count < desc.required; x++) {
+				const uint64_t key = cellKey(anchor.rule, x, y);
+				auto it = std::lower_bound(grid.begin(), grid.end(), std::make_pair(key, -1));
+				for (; it != grid.end() && it->first == key; ++it) {
+					const SpatialHit &other = spatialHits[it->second];
+					if (slotStamp[other.slot] != groupStamp && desc.spatial.isGrouped(anchor.bbox, other.bbox)) {
+						slotStamp[other.slot] = groupStamp;
+						++count;
+					}
+				}
+			}
 		}
+		groupFound[anchor.rule] = count >= desc.required;
 	}
-	return count == descriptorPtr->required;
 }
 
-float RuleMatcher::getMatchConfidence() const {
-	assert(descriptorPtr);
-	if (!descriptorPtr) {
-		return 0;
+void RuleSet::getMatchedRules(std::vector<int> &matched) const {
+	matched.clear();
+	for (int rule : touchedRules) {
+		if (isMatchFound(rule)) {
+			matched.push_back(rule);
+		}
 	}
-	if (descriptorPtr->required == -1) {
-		return descriptorPtr->words.size() == found ? 1.f : 0.f;
-		// return std::min(1.f, found / float(descriptorPtr->words.size()));
-	} else {
-		return found >= descriptorPtr->required ? 1.f : 0.f;
+	std::sort(matched.begin(), matched.end());
+}
+
+int RuleSet::matchTerm(int term, const CharPtrView &data) {
+	if (termStamp[term] != blockStamp) {
+		termStamp[term] = blockStamp;
+		TermHit::Variant variant;
+		termResult[term] = tryMatchWord(data, book->termText(term), book->termLength(term), variant) ? int8_t(variant) : -1;
+		if (termResult[term] != -1) {
+			blockTerms.push_back(term);
+		}
 	}
+	return termResult[term];
 }
 
-bool RuleMatcher::isMatchFound() const {
-	return getMatchConfidence() >= minThreshold;
+void RuleSet::clear() {
+	// only what the frame touched, a frame hits a handful of the rules
+	for (int slot : usedSlots) {
+		used[slot >> 6] = 0;
+	}
+	for (int rule : touchedRules) {
+		found[rule] = 0;
+		groupFound[rule] = 0;
+	}
+	spatialHits.clear();
+	usedSlots.clear();
+	touchedRules.clear();
+	hits.clear();
 }
 
-void RuleMatcher::clear() {
-	found = 0;
-	matches.clear();
-	std::fill(used.begin(), used.end(), false);
+bool RuleSet::isEmpty() const {
+	return !book || book->whitelist.empty();
 }
 
-bool RuleMatcher::tryMatchWord(const CharPtrView &data, const std::string& keyWord, TermMatch& match) {
+bool RuleSet::tryMatchWord(const CharPtrView &data, const char *keyWord, int length, TermHit::Variant &variant) const {
 #ifdef WITH_EDIT_DISTANCE
 	int bestDistance = INT_MAX;
-	for (int c = 0; c < len; c++) {
-		const int inputLength = std::min(len - c, int(keyWord.size()));
-		const int distance = getEditDistance(data.get() + c, inputLength, keyWord.c_str(), int(keyWord.size()));
-		if (distance < bestDistance) {
-			bestDistance = distance;
-			match = {keyWord, std::string(data.get() + c, inputLength), distance, where};
-		}
-	}
-
-	if (bestDistance <= 1) {
-		return true;
+	for (int c = 0; c < data.size(); c++) {
+		const int inputLength = std::min(data.size() - c, length);
+		const int distance = getEditDistance(data.get() + c, inputLength, keyWord, length);
+		bestDistance = std::min(bestDistance, distance);
 	}
+	variant = TermHit::Exact;
+	return bestDistance <= 1;
 #else
 	const char *end = data.get() + data.size();
-	int matchLen = int(keyWord.length());
-	const char *it = std::search(data.get(), end, keyWord.begin(), keyWord.end());
-	int distance = 0;
-	if (keyWord.length() >= 5) {
-		distance = 1;
-		--matchLen;
+	const char *it = std::search(data.get(), end, keyWord, keyWord + length);
+	variant = TermHit::Exact;
+	if (length >= 5) {
 		// try without first or last letter
 		if (it == end) {
-			it = std::search(data.get(), end, keyWord.begin() + 1, keyWord.end());
+			it = std::search(data.get(), end, keyWord + 1, keyWord + length);
+			variant = TermHit::NoFirst;
 		}
 		if (it == end) {
-			it = std::search(data.get(), end, keyWord.begin(), keyWord.end() - 1);
+			it = std::search(data.get(), end, keyWord, keyWord + length - 1);
+			variant = TermHit::NoLast;
 		}
 	}
-	if (it != end) {
-		match = {keyWord, std::string(it, matchLen), distance};
-		return true;
+	return it != end;
+#endif
+}
+
+namespace {
+const char rulebookMagic[8] = {'L', 'W', 'R', 'U', 'L', 'E', 'S', '\0'};
+const uint32_t rulebookVersion = 5;
+const uint32_t endianMark = 0x01020304;
+
+enum Section {
+	Strings,
+	Terms,
+	RuleTerms,
+	SlotRules,
+	Rules,
+	Whitelist,
+	Blacklist,
+	TermSlotStart,
+	TermSlots,
+	BucketStart,
+	BucketTerms,
+	ShortTerms,
+	TrigramFilter,
+	SectionCount,
+};
+
+/// Start of the rulebook image, sections follow 8 byte aligned
+struct ImageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint64_t checksum;
+	uint32_t stripDiacritics;
+	uint32_t bucketBits;
+	uint32_t filterBits;
+	uint32_t contentHash; ///< Of the whole image with this field zero, damaged files are rejected
+	struct {
+		uint64_t offset;
+		uint64_t count;
+	} sections[SectionCount];
+};
+
+static_assert(offsetof(ImageHeader, sections) == 40, "ImageHeader must not have padding, it is hashed as a whole");
+static_assert(sizeof(Rulebook::Term) == 8 && sizeof(Rulebook::Rule) == 44, "Rulebook image layout changed, bump rulebookVersion");
+static_assert(offsetof(Rulebook::Rule, required) == 4 && offsetof(Rulebook::Rule, isSoftMatch) == 8 && offsetof(Rulebook::Rule, isBlackList) == 9
+	&& offsetof(Rulebook::Rule, firstTerm) == 12 && offsetof(Rulebook::Rule, termCount) == 16 && offsetof(Rulebook::Rule, spatial) == 20
+	&& offsetof(SpatialConstraint, hasRegion) == 1 && offsetof(SpatialConstraint, distance) == 4 && offsetof(SpatialConstraint, region) == 8,
+	"Rulebook image layout changed, bump rulebookVersion");
+static_assert(std::is_trivially_copyable<Rulebook::Rule>::value, "Rules are mapped straight from the image");
+
+template <class T>
+void writeField(uint8_t *dest, size_t offset, const T &value) {
+	memcpy(dest + offset, &value, sizeof(T));
+}
+
+/// Write the rules into the zeroed image field by field, copying whole structs would also copy
+/// their padding bytes, which are not initialized and would make the image and contentHash differ between runs
+void writeRules(uint8_t *dest, const std::vector<Rulebook::Rule> &rules) {
+	typedef Rulebook::Rule Rule;
+	const size_t spatial = offsetof(Rule, spatial);
+	for (const Rule &rule : rules) {
+		writeField(dest, offsetof(Rule, nameOffset), rule.nameOffset);
+		writeField(dest, offsetof(Rule, required), rule.required);
+		writeField(dest, offsetof(Rule, isSoftMatch), rule.isSoftMatch);
+		writeField(dest, offsetof(Rule, isBlackList), rule.isBlackList);
+		writeField(dest, offsetof(Rule, firstTerm), rule.firstTerm);
+		writeField(dest, offsetof(Rule, termCount), rule.termCount);
+		writeField(dest, spatial + offsetof(SpatialConstraint, grouping), rule.spatial.grouping);
+		writeField(dest, spatial + offsetof(SpatialConstraint, hasRegion), rule.spatial.hasRegion);
+		writeField(dest, spatial + offsetof(SpatialConstraint, distance), rule.spatial.distance);
+		writeField(dest, spatial + offsetof(SpatialConstraint, region), rule.spatial.region);
+		dest += sizeof(Rule);
+	}
+}
+
+/// FNV-1a of the image, skipping ImageHeader::contentHash
+uint32_t imageHash(const uint8_t *image, size_t size) {
+	uint32_t hash = 2166136261u;
+	auto add = [&hash, image](size_t begin, size_t end) {
+		for (size_t c = begin; c < end; c++) {
+			hash = (hash ^ image[c]) * 16777619u;
+		}
+	};
+	const size_t skip = offsetof(ImageHeader, contentHash);
+	add(0, skip);
+	add(skip + sizeof(uint32_t), size);
+	return hash;
+}
+
+/// Check that every id in ids is in [0, limit)
+bool isInRange(const Span<int> &ids, int limit) {
+	for (int id : ids) {
+		if (id < 0 || id >= limit) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Check that range starts begin at 0, never decrease and end at the size of the ranged span
+bool isRangeTable(const Span<int> &starts, int size) {
+	if (starts.empty() || starts[0] != 0 || starts[starts.size() - 1] != size) {
+		return false;
+	}
+	for (int c = 1; c < starts.size(); c++) {
+		if (starts[c] < starts[c - 1]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Terms shorter than this are matched only exactly, longer ones also without the first or last letter
+const int variantLength = 5;
+}
+
+static uint32_t trigramHash(const char *text) {
+	const uint32_t key = uint32_t(uint8_t(text[0])) | uint32_t(uint8_t(text[1])) << 8 | uint32_t(uint8_t(text[2])) << 16;
+	return key * 2654435761u;
+}
+
+int Rulebook::trigramBucket(const char *text) const {
+	return int(trigramHash(text) >> (32 - bucketBits));
+}
+
+bool Rulebook::mayContainTerm(const char *text, int length) const {
+	for (int c = 0; c + 3 <= length; c++) {
+		const uint32_t bit = trigramHash(text + c) >> (32 - filterBits);
+		if (trigramFilter[int(bit >> 6)] & (uint64_t(1) << (bit & 63))) {
+			return true;
+		}
+	}
+	const char *end = text + length;
+	for (int term : shortTerms) {
+		if (std::search(text, end, termText(term), termText(term) + termLength(term)) != end) {
+			return true;
+		}
 	}
 	return false;
-#endif
 }
 
+bool Rulebook::compile(const std::vector<Descriptor> &descriptors, bool stripDiacritics) {
+	std::string strings;
+	std::vector<Term> terms;
+	std::vector<int> ruleTerms;
+	std::vector<int> slotRules;
+	std::vector<Rule> rules;
+	std::vector<int> whitelist;
+	std::vector<int> blacklist;
 
-void RuleSet::addBlock(const CharPtrView& data, const cv::Rect& where) {
-	for (RuleMatcher &matcher : blacklist) {
-		if (matcher.isFullMatch(data, where)) {
-			return;
+	std::unordered_map<std::string, int> interned;
+	auto intern = [&strings](const std::string &str) {
+		const int offset = int(strings.size());
+		strings.append(str);
+		strings.push_back('\0');
+		return offset;
+	};
+
+	for (const Descriptor &desc : descriptors) {
+		Rule rule;
+		rule.nameOffset = intern(desc.name);
+		rule.isSoftMatch = desc.isSoftMatch;
+		rule.isBlackList = desc.isBlackList;
+		rule.firstTerm = int(ruleTerms.size());
+		rule.termCount = int(desc.words.size());
+		rule.required = desc.required == -1 ? rule.termCount : desc.required;
+		rule.spatial = desc.spatial;
+
+		const int ruleIdx = int(rules.size());
+		for (const std::string &word : desc.words) {
+			auto it = interned.find(word);
+			if (it == interned.end()) {
+				it = interned.emplace(word, int(terms.size())).first;
+				terms.push_back({intern(word), int(word.size())});
+			}
+			ruleTerms.push_back(it->second);
+			slotRules.push_back(ruleIdx);
+		}
+
+		rules.push_back(rule);
+		if (rule.isBlackList) {
+			blacklist.push_back(ruleIdx);
+		} else {
+			whitelist.push_back(ruleIdx);
+		}
+	}
+	if (rules.empty()) {
+		return false;
+	}
+
+	// FNV-1a of the rules, the index is derived from them
+	uint64_t checksum = 14695981039346656037ull;
+	auto add = [&checksum](const void *data, size_t size) {
+		const uint8_t *bytes = static_cast<const uint8_t *>(data);
+		for (size_t c = 0; c < size; c++) {
+			checksum = (checksum ^ bytes[c]) * 1099511628211ull;
+		}
+	};
+	add(strings.data(), strings.size());
+	add(ruleTerms.data(), ruleTerms.size() * sizeof(int));
+	for (const Rule &rule : rules) {
+		const int fields[] = {rule.nameOffset, rule.required, rule.isSoftMatch, rule.isBlackList, rule.firstTerm, rule.termCount};
+		add(fields, sizeof(fields));
+		if (!rule.spatial.isEmpty()) {
+			const int spatial[] = {rule.spatial.grouping, rule.spatial.hasRegion, rule.spatial.distance};
+			add(spatial, sizeof(spatial));
+			add(rule.spatial.region, sizeof(rule.spatial.region));
+		}
+	}
+
+	// slots of each term, counting sort by term
+	std::vector<int> termSlotStart(terms.size() + 1, 0);
+	for (int term : ruleTerms) {
+		++termSlotStart[term + 1];
+	}
+	for (int c = 0; c < int(terms.size()); c++) {
+		termSlotStart[c + 1] += termSlotStart[c];
+	}
+	std::vector<int> termSlots(ruleTerms.size());
+	{
+		std::vector<int> fill(termSlotStart.begin(), termSlotStart.end() - 1);
+		for (int slot = 0; slot < int(ruleTerms.size()); slot++) {
+			termSlots[fill[ruleTerms[slot]]++] = slot;
+		}
+	}
+
+	// every variant of a long term contains its bytes 1-3, a short one is only matched whole
+	bucketBits = 6;
+	while ((size_t(1) << bucketBits) < terms.size() && bucketBits < 24) {
+		++bucketBits;
+	}
+	const int bucketCount = 1 << bucketBits;
+	std::vector<int> termBucket(terms.size(), -1);
+	std::vector<int> bucketStart(bucketCount + 1, 0);
+	std::vector<int> shortTerms;
+	for (int c = 0; c < int(terms.size()); c++) {
+		const char *text = strings.data() + terms[c].offset;
+		if (terms[c].length >= variantLength) {
+			termBucket[c] = trigramBucket(text + 1);
+		} else if (terms[c].length >= 3) {
+			termBucket[c] = trigramBucket(text);
+		} else {
+			shortTerms.push_back(c);
+			continue;
+		}
+		++bucketStart[termBucket[c] + 1];
+	}
+	for (int c = 0; c < bucketCount; c++) {
+		bucketStart[c + 1] += bucketStart[c];
+	}
+	std::vector<int> bucketTerms(bucketStart.back());
+	{
+		std::vector<int> fill(bucketStart.begin(), bucketStart.end() - 1);
+		for (int c = 0; c < int(terms.size()); c++) {
+			if (termBucket[c] != -1) {
+				bucketTerms[fill[termBucket[c]]++] = c;
+			}
 		}
 	}
 
-	for (RuleMatcher &matcher : whitelist) {
-		matcher.addBlock(data, where);
+	// about 8 bits per trigram keeps false positives of the filter low
+	int trigramCount = 0;
+	for (const Term &term : terms) {
+		trigramCount += std::max(0, term.length - 2);
 	}
+	filterBits = 10;
+	while ((size_t(1) << filterBits) < size_t(trigramCount) * 8 && filterBits < 30) {
+		++filterBits;
+	}
+	std::vector<uint64_t> trigramFilter(size_t(1) << (filterBits - 6), 0);
+	for (const Term &term : terms) {
+		for (int c = 0; c + 3 <= term.length; c++) {
+			const uint32_t bit = trigramHash(strings.data() + term.offset + c) >> (32 - filterBits);
+			trigramFilter[bit >> 6] |= uint64_t(1) << (bit & 63);
+		}
+	}
+
+	// lay out the image
+	ImageHeader header = {};
+	memcpy(header.magic, rulebookMagic, sizeof(header.magic));
+	header.version = rulebookVersion;
+	header.endian = endianMark;
+	header.checksum = checksum;
+	header.stripDiacritics = stripDiacritics;
+	header.bucketBits = uint32_t(bucketBits);
+	header.filterBits = uint32_t(filterBits);
+
+	struct Source {
+		const void *data;
+		size_t count;
+		size_t elemSize;
+	};
+	const Source sources[SectionCount] = {
+		{strings.data(), strings.size(), 1},
+		{terms.data(), terms.size(), sizeof(Term)},
+		{ruleTerms.data(), ruleTerms.size(), sizeof(int)},
+		{slotRules.data(), slotRules.size(), sizeof(int)},
+		{nullptr, rules.size(), sizeof(Rule)}, // written by writeRules
+		{whitelist.data(), whitelist.size(), sizeof(int)},
+		{blacklist.data(), blacklist.size(), sizeof(int)},
+		{termSlotStart.data(), termSlotStart.size(), sizeof(int)},
+		{termSlots.data(), termSlots.size(), sizeof(int)},
+		{bucketStart.data(), bucketStart.size(), sizeof(int)},
+		{bucketTerms.data(), bucketTerms.size(), sizeof(int)},
+		{shortTerms.data(), shortTerms.size(), sizeof(int)},
+		{trigramFilter.data(), trigramFilter.size(), sizeof(uint64_t)},
+	};
+	size_t size = sizeof(ImageHeader);
+	for (int c = 0; c < SectionCount; c++) {
+		size = (size + 7) & ~size_t(7);
+		header.sections[c].offset = size;
+		header.sections[c].count = sources[c].count;
+		size += sources[c].count * sources[c].elemSize;
+	}
+
+	std::shared_ptr<uint8_t> image(new uint8_t[size](), std::default_delete<uint8_t[]>());
+	for (int c = 0; c < SectionCount; c++) {
+		if (sources[c].data && sources[c].count) {
+			memcpy(image.get() + header.sections[c].offset, sources[c].data, sources[c].count * sources[c].elemSize);
+		}
+	}
+	writeRules(image.get() + header.sections[Rules].offset, rules);
+	memcpy(image.get(), &header, sizeof(header));
+	header.contentHash = imageHash(image.get(), size);
+	memcpy(image.get(), &header, sizeof(header));
+	return attach(image, size);
 }
 
-void RuleSet::clear() {
-	for (RuleMatcher& matcher : whitelist) {
-		matcher.clear();
+bool Rulebook::attach(std::shared_ptr<const uint8_t> image, size_t size) {
+	if (size < sizeof(ImageHeader)) {
+		return false;
+	}
+	const ImageHeader &header = *reinterpret_cast<const ImageHeader *>(image.get());
+	if (memcmp(header.magic, rulebookMagic, sizeof(header.magic)) != 0 || header.version != rulebookVersion
+		|| header.endian != endianMark || header.bucketBits < 1 || header.bucketBits > 24 || header.filterBits < 6 || header.filterBits > 30
+		|| header.contentHash != imageHash(image.get(), size)) {
+		return false;
+	}
+
+	const size_t elemSizes[SectionCount] = {1, sizeof(Term), sizeof(int), sizeof(int), sizeof(Rule),
+		sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(uint64_t)};
+	for (int c = 0; c < SectionCount; c++) {
+		const uint64_t offset = header.sections[c].offset;
+		const uint64_t count = header.sections[c].count;
+		if (offset % 8 != 0 || offset > size || count > uint64_t(INT_MAX) || count * elemSizes[c] > size - offset) {
+			return false;
+		}
+	}
+	auto span = [&header, &image](Section section, auto &out) {
+		typedef typename std::remove_reference<decltype(out)>::type SpanType;
+		out.data = reinterpret_cast<decltype(SpanType::data)>(image.get() + header.sections[section].offset);
+		out.count = int(header.sections[section].count);
+	};
+	span(Strings, strings);
+	span(Terms, terms);
+	span(RuleTerms, ruleTerms);
+	span(SlotRules, slotRules);
+	span(Rules, rules);
+	span(Whitelist, whitelist);
+	span(Blacklist, blacklist);
+	span(TermSlotStart, termSlotStart);
+	span(TermSlots, termSlots);
+	span(BucketStart, bucketStart);
+	span(BucketTerms, bucketTerms);
+	span(ShortTerms, shortTerms);
+	span(TrigramFilter, trigramFilter);
+
+	hash = header.checksum;
+	bucketBits = int(header.bucketBits);
+	filterBits = int(header.filterBits);
+	stripDiacritics = header.stripDiacritics != 0;
+	if (termSlotStart.size() != terms.size() + 1 || bucketStart.size() != (1 << bucketBits) + 1 || slotRules.size() != ruleTerms.size()
+		|| trigramFilter.size() != (1 << (filterBits - 6)) || rules.empty()) {
+		return false;
+	}
+
+	// every id and offset once, a file that passed the hash can still be crafted to read out of bounds
+	if (strings.empty() || strings[strings.size() - 1] != '\0') {
+		return false;
+	}
+	for (const Term &term : terms) {
+		if (term.offset < 0 || term.length < 0 || term.length >= strings.size() - term.offset || strings[term.offset + term.length] != '\0') {
+			return false;
+		}
+	}
+	for (const Rule &rule : rules) {
+		if (rule.nameOffset < 0 || rule.nameOffset >= strings.size() || rule.firstTerm < 0 || rule.termCount < 0
+			|| rule.termCount > ruleTerms.size() - rule.firstTerm || rule.spatial.grouping > SpatialConstraint::SameLine) {
+			return false;
+		}
 	}
+	if (!isInRange(ruleTerms, terms.size()) || !isInRange(slotRules, rules.size()) || !isInRange(whitelist, rules.size())
+		|| !isInRange(blacklist, rules.size()) || !isInRange(termSlots, ruleTerms.size()) || !isInRange(bucketTerms, terms.size())
+		|| !isInRange(shortTerms, terms.size()) || !isRangeTable(termSlotStart, termSlots.size()) || !isRangeTable(bucketStart, bucketTerms.size())) {
+		return false;
+	}
+	for (int slot = 0; slot < slotRules.size(); slot++) {
+		const Rule &rule = rules[slotRules[slot]];
+		if (slot < rule.firstTerm || slot >= rule.firstTerm + rule.termCount) {
+			return false;
+		}
+	}
+	storage = image;
+	storageSize = size;
+	return true;
 }
 
-bool RuleSet::isEmpty() const {
-	return whitelist.empty();
+bool Rulebook::save(const std::string &path) const {
+	FILE *file = fopen(path.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+	const bool isWritten = fwrite(storage.get(), 1, storageSize, file) == storageSize;
+	return fclose(file) == 0 && isWritten;
+}
+
+bool Rulebook::isCompiledFile(const std::string &path) {
+	char magic[sizeof(rulebookMagic)] = {0,};
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+	const bool isRead = fread(magic, 1, sizeof(magic), file) == sizeof(magic);
+	fclose(file);
+	return isRead && memcmp(magic, rulebookMagic, sizeof(magic)) == 0;
+}
+
+bool Rulebook::load(const std::string &path) {
+#if _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0
+		? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+	CloseHandle(file);
+	if (!mapping) {
+		return false;
+	}
+	void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!data) {
+		return false;
+	}
+	const size_t size = size_t(fileSize.QuadPart);
+	std::shared_ptr<const uint8_t> image(static_cast<const uint8_t *>(data), [](const uint8_t *ptr) {
+		UnmapViewOfFile(ptr);
+	});
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file == -1) {
+		return false;
+	}
+	struct stat info;
+	void *data = fstat(file, &info) == 0 && info.st_size > 0
+		? mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+	close(file);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	const size_t size = size_t(info.st_size);
+	std::shared_ptr<const uint8_t> image(static_cast<const uint8_t *>(data), [size](const uint8_t *ptr) {
+		munmap(const_cast<uint8_t *>(ptr), size);
+	});
+#endif
+	return attach(image, size);
+}
+
+std::string Rulebook::hitText(const TermHit &hit) const {
+	const char *text = termText(hit.term);
+	const int length = termLength(hit.term);
+	switch (hit.variant) {
+	case TermHit::NoFirst:
+		return std::string(text + 1, length - 1);
+	case TermHit::NoLast:
+		return std::string(text, length - 1);
+	default:
+		return std::string(text, length);
+	}
+}
+
+/// Parse @near=N, @line or @in=x,y,w,h with the region in percent of the frame
+static bool parseConstraint(const std::string &word, SpatialConstraint &spatial) {
+	int distance = 0;
+	float region[4];
+	char end = 0;
+	if (word == "@line") {
+		spatial.grouping = SpatialConstraint::SameLine;
+	} else if (sscanf(word.c_str(), "@near=%d%c", &distance, &end) == 1 && distance >= 0) {
+		spatial.grouping = SpatialConstraint::Near;
+		spatial.distance = distance;
+	} else if (sscanf(word.c_str(), "@in=%f,%f,%f,%f%c", &region[0], &region[1], &region[2], &region[3], &end) == 4
+		&& region[2] > 0.f && region[3] > 0.f) {
+		spatial.hasRegion = true;
+		for (int c = 0; c < 4; c++) {
+			spatial.region[c] = region[c] / 100.f;
+		}
+	} else {
+		return false;
+	}
+	return true;
 }
 
 bool MatcherFactory::init() {
+	if (Rulebook::isCompiledFile(matchersFile)) {
+		if (!rulebook.load(matchersFile)) {
+			printf("Compiled rules %s are damaged or from another version\n", matchersFile.c_str());
+			return false;
+		}
+		if (rulebook.isStripped() != stripDiacritics) {
+			printf("Compiled rules %s were built with stripDiacritics=%d\n", matchersFile.c_str(), int(rulebook.isStripped()));
+			return false;
+		}
+		return true;
+	}
+
 	std::fstream file(matchersFile, std::ios::in);
 	if (!file) {
 		return false;
 	}
 	
+	std::vector<Descriptor> descriptors;
 	std::string line;
 	int lineIdx = 0;
 	int ruleIdx = 0;
@@ -224,13 +878,20 @@ bool MatcherFactory::init() {
 				desc.isSoftMatch = true;
 				continue;
 			}
+			// anything else starting with @ is a term, like a handle
+			if (word.front() == '@' && desc.words.empty() && parseConstraint(word, desc.spatial)) {
+				continue;
+			}
 			int required = 0;
 			if (sscanf(word.c_str(), "%d", &required) == 1) {
 				desc.required = required;
 				continue;
 			}
 
-			desc.words.push_back(word);
+			word.resize(normalizeText(&word[0], int(word.size()), stripDiacritics));
+			if (!word.empty()) {
+				desc.words.push_back(word);
+			}
 		}
 		desc.words.swap(desc.words);
 		if (!desc.words.empty()) {
@@ -239,6 +900,10 @@ bool MatcherFactory::init() {
 				snprintf(nameBuff, sizeof(nameBuff), "#%d", ruleIdx);
 				desc.name = nameBuff;
 			}
+			if (desc.isBlackList && desc.spatial.grouping != SpatialConstraint::Anywhere) {
+				printf("Rule on line %d is a blacklist, its terms are matched in one block, grouping ignored\n", lineIdx);
+				desc.spatial.grouping = SpatialConstraint::Anywhere;
+			}
 			if (desc.isSoftMatch && desc.isBlackList) {
 				printf("Rule on line %d can't be both soft match and WhiteList, fallback to just whitelist\n", lineIdx);
 				desc.isSoftMatch = false;
@@ -253,35 +918,40 @@ bool MatcherFactory::init() {
 		line.clear();
 		++lineIdx;
 	}
-	return !descriptors.empty();
+	return rulebook.compile(descriptors, stripDiacritics);
 }
 
-void MatcherFactory::showInfo() const {
-	for (int c = 0; c < descriptors.size(); c++) {
+void MatcherFactory::showInfo(bool verbose) const {
+	printf("Loaded %d rules with %d terms, checksum %016llx\n", int(rulebook.rules.size()), int(rulebook.terms.size()), (unsigned long long)rulebook.checksum());
+	if (!verbose) {
+		return;
+	}
+	for (int c = 0; c < int(rulebook.rules.size()); c++) {
+		const Rulebook::Rule &rule = rulebook.rules[c];
 		const char *ruleMod = "";
-		if (descriptors[c].isSoftMatch) {
+		if (rule.isSoftMatch) {
 			ruleMod = "~";
-		} else if (descriptors[c].isBlackList) {
+		} else if (rule.isBlackList) {
 			ruleMod = "-";
 		}
-		printf("Matcher[%s%s]: ", ruleMod, descriptors[c].name.c_str());
+		printf("Matcher[%s%s]: ", ruleMod, rulebook.ruleName(c));
+		const SpatialConstraint &spatial = rule.spatial;
+		if (spatial.grouping == SpatialConstraint::Near) {
+			printf("@near=%d ", spatial.distance);
+		} else if (spatial.grouping == SpatialConstraint::SameLine) {
+			printf("@line ");
+		}
+		if (spatial.hasRegion) {
+			printf("@in=%g,%g,%g,%g ", spatial.region[0] * 100.f, spatial.region[1] * 100.f, spatial.region[2] * 100.f, spatial.region[3] * 100.f);
+		}
 
-		for (const std::string& w : descriptors[c].words) {
-			printf("%s ", w.c_str());
+		for (int r = 0; r < rule.termCount; r++) {
+			printf("%s ", rulebook.termText(rulebook.ruleTerm(c, r)));
 		}
 		puts("");
 	}
 }
 
 void MatcherFactory::create(RuleSet &ruleSet) const {
-	ruleSet.whitelist.clear();
-	ruleSet.blacklist.clear();
-	ruleSet.whitelist.reserve(descriptors.size());
-	for (const Descriptor &desc: descriptors) {
-		if (desc.isBlackList) {
-			ruleSet.blacklist.push_back(desc);
-		} else {
-			ruleSet.whitelist.push_back(desc);
-		}
-	}
+	ruleSet = RuleSet(rulebook);
 }
@@ -3,6 +3,7 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <cstdint>
 
 #include <opencv2/opencv.hpp>
 
@@ -32,88 +33,281 @@ struct CharPtrView {
 	}
 };
 
+/// Recognized text of one block with its place in the source frame, text is already normalized
+struct TextBlock {
+	CharPtrView text;
+	cv::Rect bbox;
+	float confidence = 0.f; ///< Mean recognizer confidence, 0 to 100
+
+	TextBlock copy() const;
+};
+
+typedef std::vector<TextBlock> BlockList;
+
+/// Where on screen the terms of a rule must be found
+/// Terms found in the same recognized block are at distance 0 and on the same line
+struct SpatialConstraint {
+	enum Grouping : uint8_t {
+		Anywhere = 0,
+		Near = 1, ///< the required terms are within distance pixels of one of them
+		SameLine = 2, ///< the required terms overlap vertically by half of the smaller height
+	};
+
+	Grouping grouping = Anywhere;
+	bool hasRegion = false; ///< terms only count if the center of their block is inside region
+	int distance = 0; ///< pixels, for Near
+	float region[4] = {0.f, 0.f, 1.f, 1.f}; ///< x, y, width, height as fractions of the frame
+
+	bool isEmpty() const {
+		return grouping == Anywhere && !hasRegion;
+	}
+
+	/// Check if a block is inside the region, any block is if the frame size is not known
+	bool isInside(const cv::Rect &bbox, const cv::Size &frameSize) const;
+
+	/// Check if two blocks satisfy the grouping
+	bool isGrouped(const cv::Rect &a, const cv::Rect &b) const;
+};
+
+/// Single rule as parsed from the terms file, only used while building the Rulebook
 struct Descriptor {
 	std::string name;
 	int required = -1;
 	bool isSoftMatch = false;
 	bool isBlackList = false;
+	SpatialConstraint spatial;
 	std::vector<std::string> words;
 };
 
-struct TermMatch {
-	std::string keyWord;
-	std::string actual;
-	int distance;
+/// One matched term, the actual text is recovered from the term and the variant
+struct TermHit {
+	enum Variant : uint8_t {
+		Exact = 0,
+		NoFirst = 1, ///< matched without the first letter
+		NoLast = 2, ///< matched without the last letter
+	};
+
+	int rule = -1;
+	int term = -1;
+	Variant variant = Exact;
 	cv::Rect bbox;
 };
 
-typedef std::vector<TermMatch> RuleMatch;
+typedef std::vector<TermHit> HitList;
 
-struct RuleMatcher {
+/// Read-only array inside the rulebook storage
+template<class T>
+struct Span {
+	const T *data = nullptr;
+	int count = 0;
 
-	RuleMatcher() = default;
-	RuleMatcher(const Descriptor &descriptor);
+	int size() const {
+		return count;
+	}
 
-	void addBlock(const CharPtrView &data, const cv::Rect &where);
+	bool empty() const {
+		return count == 0;
+	}
 
-	bool isFullMatch(const CharPtrView &data, const cv::Rect &where);
-	
-	float getMatchConfidence() const;
+	const T &operator[](int idx) const {
+		assert(idx >= 0 && idx < count);
+		return data[idx];
+	}
 
-	bool isMatchFound() const;
+	const T *begin() const {
+		return data;
+	}
 
-	void clear();
+	const T *end() const {
+		return data + count;
+	}
+};
 
-	const Descriptor &descriptor() const {
-		assert(descriptorPtr);
-		return *descriptorPtr;
+/// Immutable compiled form of all rules, shared read-only between all workers.
+/// Everything lives in one flat versioned image, built by compile() or memory mapped by load() from a file
+/// written by save(), so loading compiled rules is a single pass over the image to reject damaged files.
+/// Besides the rules the image has the structures used for matching:
+/// - the rule slots using each term, to go from a found term to the rules counting it
+/// - a trigram index: every term is filed under one trigram that any text containing it must contain
+/// - a bit filter of all trigrams of all terms, to cheaply screen text that can not contain any term
+struct Rulebook {
+	struct Term {
+		int offset = 0; ///< offset in strings
+		int length = 0;
+	};
+
+	struct Rule {
+		int nameOffset = 0; ///< offset in strings
+		int required = 0; ///< number of terms needed for a match, always resolved
+		bool isSoftMatch = false;
+		bool isBlackList = false;
+		int firstTerm = 0; ///< start of the rule's range in ruleTerms
+		int termCount = 0;
+		SpatialConstraint spatial;
+	};
+
+	/// @param stripDiacritics how the terms were normalized, recorded in the image
+	bool compile(const std::vector<Descriptor> &descriptors, bool stripDiacritics);
+
+	/// Write the image to a file that load() can map
+	bool save(const std::string &path) const;
+
+	/// Map a file written by save()
+	/// @return false if the file is not a compiled rulebook of this version or is damaged
+	bool load(const std::string &path);
+
+	/// Check if a file starts like a compiled rulebook
+	static bool isCompiledFile(const std::string &path);
+
+	const char *termText(int term) const {
+		return strings.data + terms[term].offset;
 	}
 
-	const RuleMatch &getMatchedTerms() const {
-		return matches;
+	int termLength(int term) const {
+		return terms[term].length;
 	}
-private:	
 
-	bool tryMatchWord(const CharPtrView &data, const std::string &keyWord, TermMatch &match);
+	const char *ruleName(int rule) const {
+		return strings.data + rules[rule].nameOffset;
+	}
 
-	int found = 0;
-	constexpr static float minThreshold = 0.3f;
-	RuleMatch matches;
+	int ruleTerm(int rule, int slot) const {
+		return ruleTerms[rules[rule].firstTerm + slot];
+	}
 
-	const Descriptor *descriptorPtr = nullptr;
+	/// Bucket of the trigram index for the 3 bytes at text
+	int trigramBucket(const char *text) const;
 
-	std::vector<bool> used;
-};
+	/// Check if text has a trigram of some term or contains a term too short to have one, false positives are possible
+	bool mayContainTerm(const char *text, int length) const;
+
+	std::string hitText(const TermHit &hit) const;
+
+	/// Hash of all rules and terms, same rules give the same rule and term ids
+	uint64_t checksum() const {
+		return hash;
+	}
+
+	bool isStripped() const {
+		return stripDiacritics;
+	}
+
+	Span<char> strings; ///< Interned terms and rule names, each zero terminated
+	Span<Term> terms; ///< Unique terms
+	Span<int> ruleTerms; ///< Term ids of all rules, each rule owns a contiguous range of slots
+	Span<int> slotRules; ///< Rule owning each slot of ruleTerms
+	Span<Rule> rules;
+	Span<int> whitelist; ///< Actual rules to match
+	Span<int> blacklist; ///< Rules that disqualify a block from matching anything
+	Span<int> termSlotStart; ///< Range of each term in termSlots, one more entry than terms
+	Span<int> termSlots; ///< Slots of ruleTerms using the term
+	Span<int> bucketStart; ///< Range of each trigram bucket in bucketTerms, one more entry than buckets
+	Span<int> bucketTerms;
+	Span<int> shortTerms; ///< Terms too short to be filed under a trigram, tried on every block
+	Span<uint64_t> trigramFilter; ///< One bit per hashed trigram of any term
 
-typedef std::vector<RuleMatcher> MatcherList;
+private:
+	/// Point all spans into the image
+	bool attach(std::shared_ptr<const uint8_t> image, size_t size);
+
+	std::shared_ptr<const uint8_t> storage; ///< Owned buffer or file mapping, shared by copies
+	size_t storageSize = 0;
+	uint64_t hash = 0;
+	int bucketBits = 0;
+	int filterBits = 0;
+	bool stripDiacritics = false;
+};
 
+/// Per worker matching state over a shared Rulebook.
+/// Only terms filed under the trigrams of a block are tried, and only the state touched by a frame is reset.
+/// Rules grouping their terms on screen keep every hit of the frame, finishFrame() looks for groups
+/// in a spatial hash of the hits, only hits in neighbouring cells are compared.
 struct RuleSet {
-	friend struct MatcherFactory;
+	RuleSet() = default;
+	explicit RuleSet(const Rulebook &rulebook);
+
+	/// Size of the frame the next blocks come from, needed for rules limited to a region
+	void setFrameSize(const cv::Size &size) {
+		frameSize = size;
+	}
+
 	void addBlock(const CharPtrView &data, const cv::Rect &where);
 
-	const MatcherList &getWhitelist() const {
-		return whitelist;
+	/// Decide the rules that group their terms, after all blocks of the frame are added
+	void finishFrame();
+
+	bool isMatchFound(int rule) const {
+		const Rulebook::Rule &desc = book->rules[rule];
+		return desc.spatial.grouping == SpatialConstraint::Anywhere ? found[rule] >= desc.required : groupFound[rule] != 0;
 	}
 
-	const MatcherList &getBlacklist() const {
-		return blacklist;
+	/// Whitelist rules matched in the current frame, in rule order
+	void getMatchedRules(std::vector<int> &matched) const;
+
+	/// All hits for the current frame, including ones for rules that are not matched
+	const HitList &getHits() const {
+		return hits;
+	}
+
+	const Rulebook &rulebook() const {
+		assert(book);
+		return *book;
 	}
 
 	void clear();
 
 	bool isEmpty() const;
 private:
-	MatcherList blacklist; ///< Rules that disqualify a block from matching anything
-	MatcherList whitelist; ///< Actual rules to match
+
+	/// Match a term against the current block, result is cached until the next block
+	int matchTerm(int term, const CharPtrView &data);
+
+	bool tryMatchWord(const CharPtrView &data, const char *keyWord, int length, TermHit::Variant &variant) const;
+
+	/// Hit of a rule that groups its terms
+	struct SpatialHit {
+		int rule = -1;
+		int slot = -1;
+		cv::Rect bbox;
+	};
+
+	/// Grid cells of a hit's bbox grown by margin
+	void getCells(const SpatialHit &hit, int margin, cv::Rect &cells) const;
+
+	const Rulebook *book = nullptr;
+	cv::Size frameSize;
+
+	std::vector<uint64_t> used; ///< One bit per slot in Rulebook::ruleTerms
+	std::vector<int> found; ///< Number of found terms per rule
+	std::vector<int> usedSlots; ///< Slots with a bit set in used
+	std::vector<int> touchedRules; ///< Rules with non zero found
+	HitList hits;
+
+	std::vector<int> termStamp; ///< Block stamp of the cached result per term
+	std::vector<int8_t> termResult; ///< Cached variant per term, -1 if not found
+	std::vector<int> blockTerms; ///< Terms found in the current block
+	std::vector<int> blockSlots; ///< Whitelist slots newly found in the current block
+	std::vector<int> ruleStamp; ///< Block stamp of blockCount per rule
+	std::vector<int> blockCount; ///< Terms of a blacklist rule found in the current block
+	int blockStamp = 0;
+
+	std::vector<uint8_t> groupFound; ///< Per rule, grouped terms found
+	std::vector<SpatialHit> spatialHits; ///< Hits of grouping rules in the current frame
+	std::vector<std::pair<uint64_t, int>> grid; ///< Sorted cell key and index in spatialHits
+	std::vector<int> slotStamp; ///< Group stamp per slot, counts each slot once per group
+	int groupStamp = 0;
 };
 
 struct MatcherFactory {
 	std::string matchersFile;
-	std::vector<Descriptor> descriptors;
+	bool stripDiacritics = false; ///< Normalize terms the same way as recognized text
+	Rulebook rulebook;
 
+	/// Load the rules from a terms file or a compiled rulebook
 	bool init();
 
-	void showInfo() const;
+	/// Print the rule and term counts, and every rule when verbose
+	void showInfo(bool verbose) const;
 
 	void create(RuleSet& ruleSet) const;
 };
@@ -0,0 +1,307 @@
+#include "Sampler.h"
+#include "OCR.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <climits>
+
+void FrameSampler::init(const Settings &settings, int begin, int end) {
+	this->end = end;
+	position = begin;
+	lastIndex = -1;
+	sampledCount = 0;
+	changeCount = 0;
+	backfill.clear();
+	lastThumb.release();
+
+	adaptive = settings.adaptiveStride;
+	if (adaptive) {
+		minStride = std::max(1, settings.minStride);
+		maxStride = std::max(minStride, settings.maxStride);
+		changeThreshold = settings.sceneChange;
+		stride = minStride;
+	} else {
+		minStride = maxStride = stride = std::max(1, settings.frameSkip);
+	}
+}
+
+bool FrameSampler::next(int &frameIndex) {
+	if (!backfill.empty()) {
+		frameIndex = backfill.front();
+		backfill.pop_front();
+		++sampledCount;
+		return true;
+	}
+
+	if (position >= end) {
+		return false;
+	}
+	frameIndex = position;
+	position += stride;
+	++sampledCount;
+	return true;
+}
+
+int FrameSampler::lowestNext() const {
+	int lowest = position < end ? position : INT_MAX;
+	for (int frameIndex : backfill) {
+		lowest = std::min(lowest, frameIndex);
+	}
+	return lowest;
+}
+
+void FrameSampler::update(int frameIndex, const cv::Mat &frame) {
+	if (!adaptive || frame.empty()) {
+		return;
+	}
+	if (frameIndex <= lastIndex) {
+		// backfilled frame, does not move the regular path
+		return;
+	}
+
+	const bool isChange = changeMetric(frame) > changeThreshold;
+	cv::swap(thumb, lastThumb);
+
+	if (isChange) {
+		++changeCount;
+		// something happened since the last sample, look at the frames in between too
+		if (lastIndex != -1 && frameIndex - lastIndex > 2 * minStride) {
+			backfill.push_back(lastIndex + (frameIndex - lastIndex) / 2);
+		}
+		stride = minStride;
+	} else {
+		stride = std::min(stride * 2, maxStride);
+	}
+	lastIndex = frameIndex;
+	position = frameIndex + stride;
+}
+
+float FrameSampler::changeMetric(const cv::Mat &frame) {
+	if (!lastThumb.empty()) {
+		cv::resize(frame, diff, lastThumb.size(), 0., 0., cv::INTER_AREA);
+	} else {
+		// ~64 pixel wide thumbnail is enough to see cuts and new text blocks
+		const double factor = 64. / frame.cols;
+		cv::resize(frame, diff, {}, factor, factor, cv::INTER_AREA);
+	}
+	cv::cvtColor(diff, thumb, cv::COLOR_BGR2GRAY);
+	if (lastThumb.empty()) {
+		return 100.f;
+	}
+
+	cv::absdiff(thumb, lastThumb, diff);
+	cv::threshold(diff, diff, 16., 255., cv::THRESH_BINARY);
+	return float(cv::countNonZero(diff)) * 100.f / float(diff.total());
+}
+
+/// Targets further ahead than this are reached with a seek instead of grabbing every frame
+static const ms seekDistance = ms(10000);
+
+bool TimeSampler::init(const Settings &settings, double fps) {
+	intervals.clear();
+	sampledCount = 0;
+	current = 0;
+	target = ms(0);
+	hasFrame = false;
+	const double frameMs = 1000. / (fps > 0. ? fps : 25.);
+	enabled = settings.sampleMs > 0 || !settings.fromTime.empty() || !settings.toTime.empty() || !settings.intervals.empty();
+	if (settings.sampleMs > 0) {
+		step = ms(settings.sampleMs);
+	} else {
+		step = ms(int64_t(std::max(1, settings.frameSkip) * frameMs));
+	}
+	step = std::max(step, ms(1));
+
+	Interval range;
+	if ((!settings.fromTime.empty() && !parseTime(settings.fromTime, range.begin))
+		|| (!settings.toTime.empty() && !parseTime(settings.toTime, range.end))) {
+		return false;
+	}
+	// -fromFrame, -toFrame and -shard limit time sampling to the times of those frames, shards stay disjoint
+	// since all of them convert their boundaries with the same fps
+	if (settings.fromFrame > 0) {
+		range.begin = std::max(range.begin, ms(int64_t(settings.fromFrame * frameMs)));
+	}
+	if (settings.toFrame != -1) {
+		const ms end(int64_t(settings.toFrame * frameMs));
+		range.end = range.end < ms(0) ? end : std::min(range.end, end);
+	}
+
+	std::stringstream list(settings.intervals);
+	std::string item;
+	while (std::getline(list, item, ',')) {
+		const size_t dash = item.find('-');
+		Interval interval;
+		if (dash == std::string::npos || !parseTime(item.substr(0, dash), interval.begin)
+			|| (dash + 1 < item.size() && !parseTime(item.substr(dash + 1), interval.end))) {
+			return false;
+		}
+		intervals.push_back(interval);
+	}
+	if (intervals.empty()) {
+		intervals.push_back(range);
+	}
+
+	// clip to from and to, then sort and join overlapping intervals
+	auto isOpen = [](const Interval &interval) {
+		return interval.end < ms(0);
+	};
+	std::vector<Interval> clipped;
+	for (Interval interval : intervals) {
+		interval.begin = std::max(interval.begin, range.begin);
+		if (!isOpen(range)) {
+			interval.end = isOpen(interval) ? range.end : std::min(interval.end, range.end);
+		}
+		if (isOpen(interval) || interval.begin < interval.end) {
+			clipped.push_back(interval);
+		}
+	}
+	std::sort(clipped.begin(), clipped.end(), [](const Interval &a, const Interval &b) {
+		return a.begin < b.begin;
+	});
+	intervals.clear();
+	for (const Interval &interval : clipped) {
+		if (!intervals.empty() && (isOpen(intervals.back()) || interval.begin <= intervals.back().end)) {
+			Interval &last = intervals.back();
+			last.end = isOpen(last) || isOpen(interval) ? ms(-1) : std::max(last.end, interval.end);
+		} else {
+			intervals.push_back(interval);
+		}
+	}
+	return true;
+}
+
+bool TimeSampler::next(VideoFile &video, cv::Mat &frame, int &frameIndex, ms &frameTime) {
+	while (current < int(intervals.size())) {
+		const Interval &interval = intervals[current];
+		const bool isOpen = interval.end < ms(0);
+		target = std::max(target, interval.begin);
+		if (!isOpen && target >= interval.end) {
+			++current;
+			continue;
+		}
+
+		if (!hasFrame || video.frameTime < target) {
+			if (target - video.frameTime > seekDistance) {
+				video.seek(target);
+			}
+			hasFrame = false;
+			while (video.grab()) {
+				if (video.frameTime >= target) {
+					hasFrame = true;
+					break;
+				}
+			}
+			if (!hasFrame) {
+				// end of the video, wherever the frame count said it would be
+				return false;
+			}
+		}
+		if (!isOpen && video.frameTime >= interval.end) {
+			// no frame in the rest of the interval, the grabbed one may still be in the next one
+			++current;
+			continue;
+		}
+
+		hasFrame = false;
+		if (!video.retrieve(frame)) {
+			return false;
+		}
+		frameIndex = video.frameIndex;
+		frameTime = video.frameTime;
+		// stay on the step grid, a long frame covers all targets it spans
+		while (target <= frameTime) {
+			target += step;
+		}
+		++sampledCount;
+		return true;
+	}
+	return false;
+}
+
+/// Width of the thumbnail that is scored, the floor is in units of this size
+static const int scoreWidth = 320;
+
+void SharpnessPicker::init(const Settings &settings) {
+	window = std::max(0, settings.sharpWindow);
+	floor = std::max(0.f, settings.sharpFloor);
+	movedCount = 0;
+	skippedCount = 0;
+}
+
+float SharpnessPicker::score(const cv::Mat &frame) {
+	const double factor = std::min(1., double(scoreWidth) / frame.cols);
+	cv::resize(frame, thumb, {}, factor, factor, cv::INTER_AREA);
+	if (thumb.channels() == 1) {
+		gray = thumb;
+	} else {
+		cv::cvtColor(thumb, gray, cv::COLOR_BGR2GRAY);
+	}
+	cv::Laplacian(gray, laplace, CV_16S);
+	cv::Scalar mean, deviation;
+	cv::meanStdDev(laplace, mean, deviation);
+	return float(deviation[0] * deviation[0]);
+}
+
+void SharpnessPicker::scoreFollowing(VideoFile &video, int count, int firstIndex, cv::Mat &best, int &bestIndex, ms &bestTime, float &bestScore) {
+	for (int c = 0; c < count; c++) {
+		if (!video.grab() || !video.retrieve(candidate)) {
+			break;
+		}
+		const float candidateScore = score(candidate);
+		if (candidateScore > bestScore) {
+			cv::swap(best, candidate);
+			bestIndex = firstIndex + c;
+			bestTime = video.frameTime;
+			bestScore = candidateScore;
+		}
+	}
+}
+
+bool SharpnessPicker::pick(VideoFile &video, cv::Mat &frame, int &frameIndex, ms &frameTime) {
+	const int sampled = frameIndex;
+	const int first = std::max(0, frameIndex - window);
+	frame = video.getFrame(first, frameTime);
+	if (frame.empty()) {
+		return false;
+	}
+	frameIndex = first;
+	float bestScore = score(frame);
+	scoreFollowing(video, sampled + window - first, first + 1, frame, frameIndex, frameTime, bestScore);
+
+	movedCount += frameIndex != sampled;
+	if (bestScore < floor) {
+		++skippedCount;
+		return false;
+	}
+	return true;
+}
+
+bool SharpnessPicker::pickAhead(VideoFile &video, cv::Mat &frame, int &frameIndex, ms &frameTime) {
+	const int sampled = frameIndex;
+	float bestScore = score(frame);
+	scoreFollowing(video, window, frameIndex + 1, frame, frameIndex, frameTime, bestScore);
+
+	movedCount += frameIndex != sampled;
+	if (bestScore < floor) {
+		++skippedCount;
+		return false;
+	}
+	return true;
+}
+
+bool getShardRange(const std::string &shard, int frameCount, int stride, int &from, int &to) {
+	int index = 0, count = 0;
+	if (sscanf(shard.c_str(), "%d/%d", &index, &count) != 2 || count < 1 || index < 0 || index >= count) {
+		return false;
+	}
+	stride = std::max(1, stride);
+	const int length = (frameCount + count - 1) / count;
+	const int aligned = (length + stride - 1) / stride * stride;
+	from = std::min(frameCount, index * aligned);
+	to = std::min(frameCount, from + aligned);
+	if (index == count - 1) {
+		to = frameCount;
+	}
+	return true;
+}
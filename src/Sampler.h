@@ -0,0 +1,129 @@
+#pragma once
+
+#include "Utils.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <deque>
+#include <vector>
+
+struct VideoFile;
+
+/// Decides which frames get decoded and recognized.
+/// With fixed stride every frameSkip-th frame is sampled, with adaptive stride sampling is densified
+/// when the picture changes (cuts, text appearing) and backs off exponentially on static content.
+/// Not thread safe, next() and update() are called under the video lock right around the decode.
+struct FrameSampler {
+	void init(const Settings &settings, int begin, int end);
+
+	/// Get the next frame to decode
+	/// @return false if there are no more frames to sample
+	bool next(int &frameIndex);
+
+	/// Report the decoded frame for the last index returned by next()
+	void update(int frameIndex, const cv::Mat &frame);
+
+	/// Lowest frame next() can still return, backfilled frames come before the regular path
+	int lowestNext() const;
+
+	int sampledCount = 0; ///< Number of frames returned by next()
+	int changeCount = 0; ///< Number of detected scene changes
+private:
+	/// Percent of thumbnail pixels that changed since the previous sample
+	float changeMetric(const cv::Mat &frame);
+
+	bool adaptive = false;
+	int minStride = 1;
+	int maxStride = 1;
+	float changeThreshold = 0.f;
+
+	int end = 0;
+	int position = 0; ///< Next frame on the regular sampling path
+	int stride = 1;
+	int lastIndex = -1; ///< Last frame on the regular path that was decoded
+	std::deque<int> backfill; ///< Frames between a change and the previous sample to check before moving on
+
+	cv::Mat lastThumb;
+	cv::Mat thumb;
+	cv::Mat diff;
+};
+
+/// Samples by presentation time instead of frame index, every step ms within time intervals.
+/// The frame count and index to time conversion are only estimates for variable frame rate video,
+/// so frames are decoded in order and their timestamps are read from the decoder, until the video actually ends.
+/// Frames between samples are only grabbed, long gaps between intervals are skipped with a seek.
+/// Not thread safe, next() is called under the video lock.
+struct TimeSampler {
+	struct Interval {
+		ms begin = ms(0);
+		ms end = ms(-1); ///< -1 for the end of the video
+	};
+
+	/// @param fps used to convert frameSkip to time if sampleMs is not set
+	/// @return false if the time settings can not be parsed
+	bool init(const Settings &settings, double fps);
+
+	/// Time based sampling is used if sampleMs or any time range is set
+	bool isEnabled() const {
+		return enabled;
+	}
+
+	/// Decode the next sample
+	/// @param frameIndex index of the decoded frame, counted from the start or estimated after a seek
+	/// @return false at the end of the video or the last interval
+	bool next(VideoFile &video, cv::Mat &frame, int &frameIndex, ms &frameTime);
+
+	int sampledCount = 0;
+	std::vector<Interval> intervals; ///< Sorted, not overlapping
+private:
+	bool enabled = false;
+	ms step = ms(1000);
+	ms target = ms(0); ///< Next sample is the first frame at or after this time
+	int current = 0; ///< Index in intervals
+	bool hasFrame = false; ///< Last grabbed frame is not consumed yet
+};
+
+/// Picks the sharpest of the frames around each sample, so a motion blurred frame or one in the middle
+/// of a transition is not sent to recognition when a clean one is a few frames away.
+/// Frames are scored by the variance of the Laplacian of a small gray thumbnail, which is high for sharp,
+/// high contrast text and low for blur, fades and flat frames. Samples with no frame reaching the quality floor are skipped.
+/// Not thread safe, pick() is called under the video lock.
+struct SharpnessPicker {
+	void init(const Settings &settings);
+
+	bool isEnabled() const {
+		return window > 0 || floor > 0.f;
+	}
+
+	/// Decode the frames from frameIndex - window to frameIndex + window and keep the sharpest
+	/// @param frameIndex sampled frame, replaced by the picked one
+	/// @return false if no frame reaches the quality floor
+	bool pick(VideoFile &video, cv::Mat &frame, int &frameIndex, ms &frameTime);
+
+	/// Keep the sharpest of frame, already decoded, and the window frames that follow it
+	/// Used with time based sampling, where earlier frames were only grabbed
+	/// @return false if no frame reaches the quality floor
+	bool pickAhead(VideoFile &video, cv::Mat &frame, int &frameIndex, ms &frameTime);
+
+	/// Laplacian variance of the frame's thumbnail
+	float score(const cv::Mat &frame);
+
+	int movedCount = 0; ///< Samples where a frame other than the sampled one was picked
+	int skippedCount = 0; ///< Samples where no frame reached the floor
+private:
+	/// Decode up to count frames following the current one and keep the best
+	void scoreFollowing(VideoFile &video, int count, int firstIndex, cv::Mat &best, int &bestIndex, ms &bestTime, float &bestScore);
+
+	int window = 0;
+	float floor = 0.f;
+
+	cv::Mat candidate;
+	cv::Mat thumb;
+	cv::Mat gray;
+	cv::Mat laplace;
+};
+
+/// Frame range of shard "i/n" of a video, shard boundaries are aligned to the sampling stride
+/// so every shard samples the same frames a single run would
+/// @return false if the shard string is invalid
+bool getShardRange(const std::string &shard, int frameCount, int stride, int &from, int &to);
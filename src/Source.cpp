@@ -1,4 +1,7 @@
 #include "OCR.h"
+#include "Calibrate.h"
+#include "Daemon.h"
+#include "ResultFile.h"
 #include "RuleMatcher.h"
 #include "Utils.h"
 
@@ -10,8 +13,8 @@
 #pragma optimize("", off)
 
 
-void printHardMatch(const MatchResult &res, VideoFile &video, const Settings &settings) {
-	const std::string &frameTime = timeToString(video.frameToMs(res.frameIndex));
+void printHardMatch(const MatchResult &res, const Settings &settings, const Rulebook &rulebook) {
+	const std::string &frameTime = timeToString(res.frameTime);
 	if (!settings.resultDir.empty()) {
 		char path[256]{0,};
 		snprintf(path, sizeof(path), "%s/frame-%s.jpeg", settings.resultDir.c_str(), frameTime.c_str());
@@ -20,70 +23,167 @@ void printHardMatch(const MatchResult &res, VideoFile &video, const Settings &se
 		printf("Matches for frame [%d] (%s) {\n", res.frameIndex, frameTime.c_str());
 	}
 
-	const MatcherList &whitelist = res.ruleSet.getWhitelist();
-	for (int c = 0; c < int(res.whitelistIndices.size()); c++) {
-		const RuleMatcher &matcher = whitelist[res.whitelistIndices[c]];
-		if (!matcher.isMatchFound() || matcher.descriptor().isSoftMatch) {
+	for (int rule : res.ruleIndices) {
+		if (rulebook.rules[rule].isSoftMatch) {
 			continue;
 		}
 
-		printf("\t%s: ", matcher.descriptor().name.c_str());
+		printf("\t%s: ", rulebook.ruleName(rule));
 
-		const RuleMatch& termList = matcher.getMatchedTerms();
-		for (int r = 0; r < termList.size(); r++) {
-			printf("(%s)", termList[r].actual.c_str());
-			if (r + 1 != termList.size()) {
-				printf(" ");
+		bool first = true;
+		for (const TermHit &hit : res.hits) {
+			if (hit.rule != rule) {
+				continue;
 			}
+			printf(first ? "(%s)" : " (%s)", rulebook.hitText(hit).c_str());
+			first = false;
 		}
 		puts("");
 	}
 	puts("}");
 }
 
-void printResults(const ThreadedOCR &context, VideoFile &video, const Settings &settings, const MatcherFactory &matcherFactory) {
-	const MatchResult &first = context.results.front();
-	const ms matchMs = video.frameToMs(first.frameIndex);
-	printf("First match found in [%s] at time %s, frame %d\n", settings.videoPath.c_str(), timeToString(matchMs).c_str(), first.frameIndex);
+/// @param frames store with the result frames, can be null
+/// @param video used to decode frames that are not in the store, can be null
+void printResults(const std::vector<MatchResult> &results, FrameStore *frames, VideoFile *video, const Settings &settings, const MatcherFactory &matcherFactory) {
+	const MatchResult &first = results.front();
+	printf("First match found in [%s] at time %s, frame %d\n", settings.videoPath.c_str(), timeToString(first.frameTime).c_str(), first.frameIndex);
 
 	if (!settings.silent) {
 		struct SoftMatchInfo {
-			std::vector<int> frames;
+			std::vector<const MatchResult *> frames;
 		};
 		std::map<int, SoftMatchInfo> softMatches;
-		for (const MatchResult &res : context.results) {
+		for (const MatchResult &res : results) {
 			if (res.matchType & MatchResult::HardMatch) {
-				printHardMatch(res, video, settings);
+				printHardMatch(res, settings, matcherFactory.rulebook);
 			}
 			if (res.matchType & MatchResult::SoftMatch) {
-				for (int c = 0; c < int(res.whitelistIndices.size()); c++) {
-					SoftMatchInfo &info = softMatches[res.whitelistIndices[c]];
-					info.frames.push_back(res.frameIndex);
+				for (int rule : res.ruleIndices) {
+					if (matcherFactory.rulebook.rules[rule].isSoftMatch) {
+						softMatches[rule].frames.push_back(&res);
+					}
 				}
 			}
 		}
 
-		RuleSet set;
-		matcherFactory.create(set);
-		// need only names
-		const MatcherList &whitelist = set.getWhitelist();
 		for (const auto &pair : softMatches) {
-			printf("Soft match [%s] at {", whitelist[pair.first].descriptor().name.c_str());
+			printf("Soft match [%s] at {", matcherFactory.rulebook.ruleName(pair.first));
 			for (int c = 0; c < int(pair.second.frames.size()); c++) {
-				const std::string frameStr = timeToString(video.frameToMs(pair.second.frames[c]));
-				printf("[%d %s]", pair.second.frames[c], frameStr.c_str());
+				const MatchResult &res = *pair.second.frames[c];
+				printf("[%d %s]", res.frameIndex, timeToString(res.frameTime).c_str());
 			}
 			puts("}");
 		}
 	}
 
 	if (settings.showFrame) {
-		cv::imshow("TermMatch", first.frame);
+		cv::Mat frame;
+		for (const MatchResult &res : results) {
+			if (frames && res.frameHandle != -1) {
+				frame = frames->get(res.frameHandle);
+				break;
+			}
+		}
+		if (frame.empty() && video) {
+			frame = video->getFrame(first.frameIndex);
+		}
+		if (!frame.empty()) {
+			cv::imshow("TermMatch", frame);
+		}
 		printf("Press any key to exit\n");
 		cv::waitKey(0);
 	}
 }
 
+/// Combine the partial results of several shards and print them like a single run
+int mergeShards(const Settings &settings) {
+	MatcherFactory matcherFactory;
+	matcherFactory.matchersFile = settings.termsFile;
+	matcherFactory.stripDiacritics = settings.stripDiacritics;
+	if (!matcherFactory.init()) {
+		puts("Failed to load matchers");
+		return 0;
+	}
+
+	std::vector<PartialResults> shards;
+	std::stringstream files(settings.mergeFiles);
+	std::string path;
+	while (std::getline(files, path, ',')) {
+		shards.emplace_back();
+		if (!shards.back().read(path)) {
+			printf("Failed to read partial results %s\n", path.c_str());
+			return 0;
+		}
+	}
+
+	std::vector<MatchResult> results;
+	if (shards.empty() || !mergeResults(shards, matcherFactory.rulebook, settings.matchLimit, results)) {
+		puts("Failed to merge results");
+		return 0;
+	}
+
+	int hardMatches = 0;
+	for (const MatchResult &res : results) {
+		hardMatches += (res.matchType & MatchResult::HardMatch) != 0;
+	}
+	if (hardMatches > 0) {
+		Settings printSettings = settings;
+		if (printSettings.videoPath.empty()) {
+			printSettings.videoPath = shards.front().videoPath;
+		}
+		VideoFile video;
+		const bool hasVideo = settings.showFrame && video.init(printSettings);
+		printResults(results, nullptr, hasVideo ? &video : nullptr, printSettings, matcherFactory);
+	}
+	cv::destroyAllWindows();
+	return hardMatches == settings.matchLimit;
+}
+
+/// Parse the terms once and write the binary rulebook, loading it later is a single pass over the image to reject damaged files
+int compileRules(const Settings &settings) {
+	MatcherFactory matcherFactory;
+	matcherFactory.matchersFile = settings.termsFile;
+	matcherFactory.stripDiacritics = settings.stripDiacritics;
+	if (!matcherFactory.init()) {
+		puts("Failed to load matchers");
+		return 0;
+	}
+	if (!matcherFactory.rulebook.save(settings.compileRules)) {
+		printf("Failed to write rulebook %s\n", settings.compileRules.c_str());
+		return 0;
+	}
+	printf("Compiled %d rules with %d terms to %s\n", matcherFactory.rulebook.rules.size(), matcherFactory.rulebook.terms.size(), settings.compileRules.c_str());
+	return 1;
+}
+
+/// Tune the settings on a clip of the video and write them as a profile
+int calibrate(const Settings &settings, const CpuTopology &topology) {
+	VideoFile video;
+	if (!video.init(settings)) {
+		printf("Failed to open file %s\n", settings.videoPath.c_str());
+		return 0;
+	}
+	MatcherFactory matcherFactory;
+	matcherFactory.matchersFile = settings.termsFile;
+	matcherFactory.stripDiacritics = settings.stripDiacritics;
+	if (!matcherFactory.init()) {
+		puts("Failed to load matchers");
+		return 0;
+	}
+
+	Calibrator calibrator(settings, topology, matcherFactory, video);
+	if (!calibrator.run()) {
+		return 0;
+	}
+	if (!calibrator.writeProfile(settings.calibrate)) {
+		printf("Failed to write profile %s\n", settings.calibrate.c_str());
+		return 0;
+	}
+	printf("Profile written to %s, use it with -profile=%s\n", settings.calibrate.c_str(), settings.calibrate.c_str());
+	return 1;
+}
+
 int main(int argc, char *argv[]) {
 	const Settings settings = Settings::getSettings(argc, argv);
 	if (!settings.checkAndPrint()) {
@@ -94,25 +194,83 @@ int main(int argc, char *argv[]) {
 		//settings.printValues();
 	}
 
+	if (!settings.compileRules.empty()) {
+		return compileRules(settings);
+	}
+	if (!settings.mergeFiles.empty()) {
+		return mergeShards(settings);
+	}
+
 	using namespace std;
 	using namespace chrono;
 
+	if (!limitEngineThreads(settings.engineThreads, settings.silent, argv)) {
+		printf("Failed to limit the engines to %d thread(s), they use one per core\n", settings.engineThreads);
+	}
 	const high_resolution_clock::time_point start = high_resolution_clock::now();
+	CpuTopology topology;
+	topology.detect();
+	const PlacementPlan placement = PlacementPlan::make(topology, settings, settings.threadCount);
+	if (!settings.silent) {
+		placement.print(topology);
+	}
+
+	if (!settings.calibrate.empty()) {
+		return calibrate(settings, topology);
+	}
+
+	if (!settings.daemonSocket.empty()) {
+		Daemon daemon(settings, placement);
+		if (!daemon.init()) {
+			puts("Failed to start daemon");
+			return 0;
+		}
+		daemon.run();
+		return 1;
+	}
+	// decoder threads are created when the video is opened and inherit this
+	if (!placement.pinToReserved()) {
+		puts("Failed to pin to the reserved cpus, decoding is not pinned");
+	}
+
 	VideoFile video;
 	if (!video.init(settings)) {
 		printf("Failed to open file %s\n", settings.videoPath.c_str());
 		return 0;
 	}
 
-	MatcherFactory matcherFactory{settings.termsFile};
+	MatcherFactory matcherFactory;
+	matcherFactory.matchersFile = settings.termsFile;
+	matcherFactory.stripDiacritics = settings.stripDiacritics;
 	if (!matcherFactory.init()) {
 		puts("Failed to load matchers");
 		return 0;
 	}
-	matcherFactory.showInfo();
+	if (!settings.silent) {
+		matcherFactory.showInfo(settings.verbose);
+	}
+
+	Settings runSettings = settings;
+	if (!settings.shard.empty()) {
+		int from = 0, to = 0;
+		if (!getShardRange(settings.shard, video.frameCount, settings.frameSkip, from, to)) {
+			printf("Invalid shard %s, expected i/n\n", settings.shard.c_str());
+			return 0;
+		}
+		runSettings.fromFrame = std::max(from, settings.fromFrame);
+		runSettings.toFrame = settings.toFrame == -1 ? to : std::min(to, settings.toFrame);
+		if (settings.toFrame == -1 && to == video.frameCount) {
+			// the last shard reads to the real end, time sampling can go past a wrong frame count
+			runSettings.toFrame = -1;
+		}
+		if (!settings.silent) {
+			printf("Shard %s: frames [%d, %d)\n", settings.shard.c_str(), runSettings.fromFrame, to);
+		}
+	}
 
-	ThreadedOCR threadedOCR(settings, matcherFactory, video);
-	if (!threadedOCR.start(settings.threadCount)) {
+	ThreadedOCR threadedOCR(runSettings, matcherFactory, video);
+	threadedOCR.placement = placement;
+	if (!threadedOCR.start(placement.workerCount())) {
 		puts("Failed to start threads");
 		return 0;
 	}
@@ -123,10 +281,45 @@ int main(int argc, char *argv[]) {
 	const ms processingMs = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 	if (!settings.silent) {
 		printf("Processing time time %s [%dms]\n", timeToString(processingMs).c_str(), int(processingMs.count()));
+		printf("Sampled %d frames, %d scene changes\n", threadedOCR.sampledCount(), threadedOCR.sampler.changeCount);
+		if (settings.cascade) {
+			const CascadeStats &cascade = threadedOCR.cascade;
+			printf("Cascade escalated %d of %d lines (%.1f%%) in %d regions, %d regions (%.1f%%) had a term\n",
+				cascade.escalatedLines, cascade.screenedLines, 100.f * cascade.escalatedLines / std::max(1, cascade.screenedLines),
+				cascade.escalatedRegions, cascade.confirmedRegions, 100.f * cascade.confirmedRegions / std::max(1, cascade.escalatedRegions));
+		}
+		if (threadedOCR.picker.isEnabled()) {
+			printf("Sharper frame picked for %d samples, %d samples below the floor skipped\n",
+				threadedOCR.picker.movedCount, threadedOCR.picker.skippedCount);
+		}
+	}
+	if (!threadedOCR.timedOutFrames.empty()) {
+		std::sort(threadedOCR.timedOutFrames.begin(), threadedOCR.timedOutFrames.end());
+		printf("%d frames over the %dms budget were not matched: {", int(threadedOCR.timedOutFrames.size()), settings.frameBudgetMs);
+		for (int frameIndex : threadedOCR.timedOutFrames) {
+			printf("[%d]", frameIndex);
+		}
+		puts("}");
+	}
+
+	// results are already in frame order and cut at matchLimit
+	if (!settings.partialOut.empty()) {
+		PartialResults partial;
+		partial.videoPath = settings.videoPath;
+		partial.frameCount = video.frameCount;
+		partial.fromFrame = std::max(0, runSettings.fromFrame);
+		partial.toFrame = runSettings.toFrame == -1 ? video.frameCount : runSettings.toFrame;
+		partial.matchLimit = settings.matchLimit;
+		partial.stoppedAtLimit = threadedOCR.remainingMatches <= 0;
+		partial.rulesChecksum = matcherFactory.rulebook.checksum();
+		partial.results = threadedOCR.results;
+		if (!partial.write(settings.partialOut)) {
+			printf("Failed to write partial results %s\n", settings.partialOut.c_str());
+		}
 	}
 
 	if (threadedOCR.foundAnyMatches()) {
-		printResults(threadedOCR, video, settings, matcherFactory);
+		printResults(threadedOCR.results, &threadedOCR.frames, &video, settings, matcherFactory);
 	}
 
 	cv::destroyAllWindows();
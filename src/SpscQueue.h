@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/// Bounded lock free queue for exactly one producer and one consumer thread.
+/// Each side only writes its own index and reads the other's with acquire,
+/// so a slot is completely written before the consumer can see it and completely read before it is reused.
+template <typename T>
+struct SpscQueue {
+	explicit SpscQueue(int capacity)
+		: slots(size_t(capacity) + 1)
+	{}
+
+	SpscQueue(const SpscQueue &) = delete;
+	SpscQueue &operator=(const SpscQueue &) = delete;
+
+	/// Producer side
+	/// @return false if the queue is full, item is not moved from
+	bool push(T &item) {
+		const size_t pos = tail.load(std::memory_order_relaxed);
+		const size_t nextPos = pos + 1 == slots.size() ? 0 : pos + 1;
+		if (nextPos == head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		slots[pos] = std::move(item);
+		tail.store(nextPos, std::memory_order_release);
+		return true;
+	}
+
+	/// Consumer side
+	/// @return false if the queue is empty
+	bool pop(T &item) {
+		const size_t pos = head.load(std::memory_order_relaxed);
+		if (pos == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = std::move(slots[pos]);
+		head.store(pos + 1 == slots.size() ? 0 : pos + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<T> slots; ///< One slot more than the capacity, a full queue is not mistaken for an empty one
+	std::atomic<size_t> head = 0; ///< Next slot to pop, written by the consumer
+	std::atomic<size_t> tail = 0; ///< Next slot to push, written by the producer
+};
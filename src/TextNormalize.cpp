@@ -0,0 +1,300 @@
+#include "TextNormalize.h"
+#include "TextNormalizeImpl.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NORMALIZE_SSE2 1
+#endif
+
+#include <algorithm>
+#include <iterator>
+
+#if NORMALIZE_HAS_AVX2 && defined(_MSC_VER)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+/// Base letters for U+00C0 - U+017F, '-' keeps the letter as is
+static const char latinBase[] =
+	"aaaaaa-ceeeeiiiidnooooo-ouuuuy--"
+	"aaaaaa-ceeeeiiiidnooooo-ouuuuy-y"
+	"aaaaaaccccccccddddeeeeeeeeeegggg"
+	"gggghhhhiiiiiiiiii--jjkk-lllllll"
+	"lllnnnnnn---oooooo--rrrrrrssssss"
+	"ssttttttuuuuuuuuuuuuwwyyyzzzzzz-";
+
+static_assert(sizeof(latinBase) == 0x180 - 0xC0 + 1, "Latin base table must cover U+00C0 - U+017F");
+
+/// Base letters for Latin Extended Additional U+1E00 - U+1EFF (Vietnamese and others), '-' keeps the letter as is
+static const char latinAdditionalBase[] =
+	"aabbbbbbccddddddddddeeeeeeeeeeff"
+	"gghhhhhhhhhhiiiikkkkkkllllllllmm"
+	"mmmmnnnnnnnnoooooooopppprrrrrrrr"
+	"ssssssssssttttttttuuuuuuuuuuvvvv"
+	"wwwwwwwwwwxxxxyyzzzzzzhtwy-s----"
+	"aaaaaaaaaaaaaaaaaaaaaaaaeeeeeeee"
+	"eeeeeeeeiiiioooooooooooooooooooo"
+	"oooouuuuuuuuuuuuuuyyyyyyyy------";
+
+static_assert(sizeof(latinAdditionalBase) == 0x100 + 1, "Latin Extended Additional table must cover U+1E00 - U+1EFF");
+
+/// Base letters for Greek Extended U+1F00 - U+1FFF, a letter stands for the greek letter with the same sound, '-' keeps it
+static const char greekExtendedBase[] =
+	"aaaaaaaaaaaaaaaaeeeeee--eeeeee--"
+	"hhhhhhhhhhhhhhhhiiiiiiiiiiiiiiii"
+	"oooooo--oooooo--uuuuuuuu-u-u-u-u"
+	"wwwwwwwwwwwwwwwwaaeehhiioouuww--"
+	"aaaaaaaaaaaaaaaahhhhhhhhhhhhhhhh"
+	"wwwwwwwwwwwwwwwwaaaaa-aaaaaaa---"
+	"--hhh-hheehhh---iiii--iiiiii----"
+	"uuuurruuuuuur-----www-wwoowww---";
+
+static_assert(sizeof(greekExtendedBase) == 0x100 + 1, "Greek Extended table must cover U+1F00 - U+1FFF");
+
+/// Simple case folding of the code points encoded in 3 bytes:
+/// every stride-th code point from first to last folds to cp + delta
+struct FoldRange {
+	uint16_t first;
+	uint16_t last;
+	int32_t delta;
+	uint8_t stride;
+};
+
+/// Sorted and not overlapping, generated from the Unicode 14 case folding data
+static const FoldRange foldRanges[] = {
+	{0x10A0, 0x10C5, 7264, 1}, {0x10C7, 0x10C7, 7264, 1}, {0x10CD, 0x10CD, 7264, 1}, // Georgian
+	{0x13F8, 0x13FD, -8, 1}, // Cherokee
+	{0x1C80, 0x1C80, -6222, 1}, {0x1C81, 0x1C81, -6221, 1}, {0x1C82, 0x1C82, -6212, 1}, {0x1C83, 0x1C84, -6210, 1},
+	{0x1C85, 0x1C85, -6211, 1}, {0x1C86, 0x1C86, -6204, 1}, {0x1C87, 0x1C87, -6180, 1}, {0x1C88, 0x1C88, 35267, 1},
+	{0x1C90, 0x1CBA, -3008, 1}, {0x1CBD, 0x1CBF, -3008, 1}, // Georgian Mtavruli
+	{0x1E00, 0x1E94, 1, 2}, {0x1E9B, 0x1E9B, -58, 1}, {0x1E9E, 0x1E9E, -7615, 1}, {0x1EA0, 0x1EFE, 1, 2},
+	{0x1F08, 0x1F0F, -8, 1}, {0x1F18, 0x1F1D, -8, 1}, {0x1F28, 0x1F2F, -8, 1}, {0x1F38, 0x1F3F, -8, 1},
+	{0x1F48, 0x1F4D, -8, 1}, {0x1F59, 0x1F5F, -8, 2}, {0x1F68, 0x1F6F, -8, 1}, {0x1F88, 0x1F8F, -8, 1},
+	{0x1F98, 0x1F9F, -8, 1}, {0x1FA8, 0x1FAF, -8, 1}, {0x1FB8, 0x1FB9, -8, 1}, {0x1FBA, 0x1FBB, -74, 1},
+	{0x1FBC, 0x1FBC, -9, 1}, {0x1FBE, 0x1FBE, -7173, 1}, {0x1FC8, 0x1FCB, -86, 1}, {0x1FCC, 0x1FCC, -9, 1},
+	{0x1FD8, 0x1FD9, -8, 1}, {0x1FDA, 0x1FDB, -100, 1}, {0x1FE8, 0x1FE9, -8, 1}, {0x1FEA, 0x1FEB, -112, 1},
+	{0x1FEC, 0x1FEC, -7, 1}, {0x1FF8, 0x1FF9, -128, 1}, {0x1FFA, 0x1FFB, -126, 1}, {0x1FFC, 0x1FFC, -9, 1},
+	{0x2126, 0x2126, -7517, 1}, {0x212A, 0x212A, -8383, 1}, {0x212B, 0x212B, -8262, 1}, {0x2132, 0x2132, 28, 1},
+	{0x2160, 0x216F, 16, 1}, {0x2183, 0x2183, 1, 1}, {0x24B6, 0x24CF, 26, 1},
+	{0x2C00, 0x2C2F, 48, 1}, {0x2C60, 0x2C60, 1, 1}, {0x2C62, 0x2C62, -10743, 1}, {0x2C63, 0x2C63, -3814, 1},
+	{0x2C64, 0x2C64, -10727, 1}, {0x2C67, 0x2C6B, 1, 2}, {0x2C6D, 0x2C6D, -10780, 1}, {0x2C6E, 0x2C6E, -10749, 1},
+	{0x2C6F, 0x2C6F, -10783, 1}, {0x2C70, 0x2C70, -10782, 1}, {0x2C72, 0x2C72, 1, 1}, {0x2C75, 0x2C75, 1, 1},
+	{0x2C7E, 0x2C7F, -10815, 1}, {0x2C80, 0x2CE2, 1, 2}, {0x2CEB, 0x2CED, 1, 2}, {0x2CF2, 0x2CF2, 1, 1},
+	{0xA640, 0xA66C, 1, 2}, {0xA680, 0xA69A, 1, 2}, {0xA722, 0xA72E, 1, 2}, {0xA732, 0xA76E, 1, 2},
+	{0xA779, 0xA77B, 1, 2}, {0xA77D, 0xA77D, -35332, 1}, {0xA77E, 0xA786, 1, 2}, {0xA78B, 0xA78B, 1, 1},
+	{0xA78D, 0xA78D, -42280, 1}, {0xA790, 0xA792, 1, 2}, {0xA796, 0xA7A8, 1, 2}, {0xA7AA, 0xA7AA, -42308, 1},
+	{0xA7AB, 0xA7AB, -42319, 1}, {0xA7AC, 0xA7AC, -42315, 1}, {0xA7AD, 0xA7AD, -42305, 1}, {0xA7AE, 0xA7AE, -42308, 1},
+	{0xA7B0, 0xA7B0, -42258, 1}, {0xA7B1, 0xA7B1, -42282, 1}, {0xA7B2, 0xA7B2, -42261, 1}, {0xA7B3, 0xA7B3, 928, 1},
+	{0xA7B4, 0xA7C2, 1, 2}, {0xA7C4, 0xA7C4, -48, 1}, {0xA7C5, 0xA7C5, -42307, 1}, {0xA7C6, 0xA7C6, -35384, 1},
+	{0xA7C7, 0xA7C9, 1, 2}, {0xA7D0, 0xA7D0, 1, 1}, {0xA7D6, 0xA7D8, 1, 2}, {0xA7F5, 0xA7F5, 1, 1},
+	{0xAB70, 0xABBF, -38864, 1}, // Cherokee small letters fold to the capitals
+	{0xFF21, 0xFF3A, 32, 1}, // fullwidth Latin
+};
+
+static uint32_t foldRange(uint32_t cp) {
+	const FoldRange *range = std::lower_bound(std::begin(foldRanges), std::end(foldRanges), cp,
+		[](const FoldRange &r, uint32_t value) { return r.last < value; });
+	if (range == std::end(foldRanges) || cp < range->first || (cp - range->first) % range->stride != 0) {
+		return cp;
+	}
+	return uint32_t(int32_t(cp) + range->delta);
+}
+
+uint32_t textNormalize::foldCase(uint32_t cp) {
+	if (cp < 0x80) {
+		return cp >= 'A' && cp <= 'Z' ? cp | 0x20 : cp;
+	}
+	if (cp < 0x100) {
+		if (cp == 0xB5) {
+			return 0x3BC; // micro sign to greek mu
+		}
+		return cp >= 0xC0 && cp <= 0xDE && cp != 0xD7 ? cp + 0x20 : cp;
+	}
+	if (cp < 0x180) {
+		switch (cp) {
+		case 0x130: return 'i'; // full folding would make the text longer
+		case 0x131: case 0x138: case 0x149: return cp;
+		case 0x178: return 0xFF;
+		case 0x17F: return 's';
+		}
+		if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E)) {
+			return (cp & 1) ? cp + 1 : cp;
+		}
+		return cp | 1;
+	}
+	if (cp < 0x250) {
+		switch (cp) {
+		case 0x1AF: return 0x1B0;
+		case 0x1C4: case 0x1C5: return 0x1C6;
+		case 0x1C7: case 0x1C8: return 0x1C9;
+		case 0x1CA: case 0x1CB: return 0x1CC;
+		case 0x1F1: case 0x1F2: return 0x1F3;
+		case 0x1F4: return 0x1F5;
+		}
+		if ((cp >= 0x1A0 && cp <= 0x1A5) || (cp >= 0x1DE && cp <= 0x1EF) || (cp >= 0x1F8 && cp <= 0x21F) || (cp >= 0x222 && cp <= 0x233) || (cp >= 0x246 && cp <= 0x24F)) {
+			return cp | 1;
+		}
+		if (cp >= 0x1CD && cp <= 0x1DC) {
+			return (cp & 1) ? cp + 1 : cp;
+		}
+		return cp;
+	}
+	if (cp >= 0x370 && cp < 0x400) {
+		if (cp >= 0x391 && cp <= 0x3AB && cp != 0x3A2) {
+			return cp + 0x20;
+		}
+		switch (cp) {
+		case 0x386: return 0x3AC;
+		case 0x388: case 0x389: case 0x38A: return cp + 0x25;
+		case 0x38C: return 0x3CC;
+		case 0x38E: case 0x38F: return cp + 0x3F;
+		case 0x3C2: return 0x3C3; // final sigma
+		case 0x3D0: return 0x3B2;
+		case 0x3D1: return 0x3B8;
+		case 0x3D5: return 0x3C6;
+		case 0x3D6: return 0x3C0;
+		case 0x3F0: return 0x3BA;
+		case 0x3F1: return 0x3C1;
+		case 0x3F5: return 0x3B5;
+		}
+		return cp >= 0x3D8 && cp <= 0x3EF ? cp | 1 : cp;
+	}
+	if (cp >= 0x400 && cp < 0x530) {
+		if (cp < 0x410) {
+			return cp + 0x50;
+		}
+		if (cp < 0x430) {
+			return cp + 0x20;
+		}
+		if ((cp >= 0x460 && cp <= 0x481) || (cp >= 0x48A && cp <= 0x4BF) || cp >= 0x4D0) {
+			return cp | 1;
+		}
+		if (cp == 0x4C0) {
+			return 0x4CF;
+		}
+		if (cp >= 0x4C1 && cp <= 0x4CE) {
+			return (cp & 1) ? cp + 1 : cp;
+		}
+		return cp;
+	}
+	if (cp >= 0x531 && cp <= 0x556) {
+		return cp + 0x30;
+	}
+	return cp >= 0x800 ? foldRange(cp) : cp;
+}
+
+uint32_t textNormalize::stripMark(uint32_t cp) {
+	if (cp >= 0xC0 && cp < 0x180) {
+		const char base = latinBase[cp - 0xC0];
+		return base == '-' ? cp : uint32_t(base);
+	}
+	if (cp >= 0x1E00 && cp < 0x1F00) {
+		const char base = latinAdditionalBase[cp - 0x1E00];
+		return base == '-' ? cp : uint32_t(base);
+	}
+	if (cp >= 0x1F00 && cp < 0x2000) {
+		switch (greekExtendedBase[cp - 0x1F00]) {
+		case 'a': return 0x3B1;
+		case 'e': return 0x3B5;
+		case 'h': return 0x3B7;
+		case 'i': return 0x3B9;
+		case 'o': return 0x3BF;
+		case 'r': return 0x3C1;
+		case 'u': return 0x3C5;
+		case 'w': return 0x3C9;
+		}
+		return cp;
+	}
+	switch (cp) {
+	case 0x1A1: return 'o';
+	case 0x1B0: return 'u';
+	case 0x390: case 0x3AF: case 0x3CA: return 0x3B9;
+	case 0x3AC: return 0x3B1;
+	case 0x3AD: return 0x3B5;
+	case 0x3AE: return 0x3B7;
+	case 0x3B0: case 0x3CB: case 0x3CD: return 0x3C5;
+	case 0x3CC: return 0x3BF;
+	case 0x3CE: return 0x3C9;
+	case 0x439: case 0x45D: return 0x438;
+	case 0x450: case 0x451: return 0x435;
+	case 0x453: return 0x433;
+	case 0x457: return 0x456;
+	case 0x45C: return 0x43A;
+	case 0x45E: return 0x443;
+	}
+	return cp;
+}
+
+bool textNormalize::isCombiningMark(uint32_t cp) {
+	return (cp >= 0x300 && cp <= 0x36F) || (cp >= 0x1AB0 && cp <= 0x1AFF) || (cp >= 0x1DC0 && cp <= 0x1DFF)
+		|| (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE20 && cp <= 0xFE2F);
+}
+
+bool textNormalize::isUnicodeSpace(uint32_t cp) {
+	return cp == 0xA0 || (cp >= 0x2000 && cp <= 0x200B) || cp == 0x202F || cp == 0x205F || cp == 0x3000;
+}
+
+#if NORMALIZE_SSE2
+namespace {
+
+struct Sse2Chunk {
+	static const int size = 16;
+
+	/// @return false if the chunk is not printable ASCII with single spaces, nothing is written then
+	static bool lower(const uint8_t *in, uint8_t *out, bool &lastSpace) {
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+		const uint32_t special = uint32_t(_mm_movemask_epi8(_mm_or_si128(
+			_mm_cmplt_epi8(chunk, _mm_set1_epi8(' ')),
+			_mm_cmpeq_epi8(chunk, _mm_set1_epi8(0x7F)))));
+		const uint32_t spaces = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '))));
+		if (special != 0 || (spaces & (spaces >> 1)) != 0 || (lastSpace && (spaces & 1))) {
+			return false;
+		}
+		const __m128i upper = _mm_and_si128(
+			_mm_cmpgt_epi8(chunk, _mm_set1_epi8('A' - 1)),
+			_mm_cmplt_epi8(chunk, _mm_set1_epi8('Z' + 1)));
+		const __m128i lower = _mm_or_si128(chunk, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), lower);
+		lastSpace = (spaces >> 15) != 0;
+		return true;
+	}
+};
+
+}
+
+typedef Sse2Chunk BaselineChunk;
+#else
+typedef ScalarChunk BaselineChunk;
+#endif
+
+#if NORMALIZE_HAS_AVX2
+bool textNormalize::isAvx2Supported() {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	// the OS must also save the upper halves of the registers
+	__cpuid(info, 1);
+	const bool hasAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+	if (!hasAvx || (_xgetbv(0) & 6) != 6) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+int normalizeText(char *text, int length, bool stripDiacritics) {
+#if NORMALIZE_HAS_AVX2
+	static const bool useAvx2 = textNormalize::isAvx2Supported();
+	if (useAvx2) {
+		return textNormalize::normalizeAvx2(text, length, stripDiacritics);
+	}
+#endif
+	return normalizeWith<BaselineChunk>(text, length, stripDiacritics);
+}
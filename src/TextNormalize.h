@@ -0,0 +1,10 @@
+#pragma once
+
+/// Normalize UTF-8 text in place in a single pass:
+/// - case folding for Latin, Greek, Cyrillic, Armenian, Georgian, Cherokee, Coptic, Glagolitic and fullwidth Latin letters
+/// - optionally strip diacritics (Latin, Latin Extended Additional, Greek, Greek Extended and Cyrillic letters and combining marks)
+/// - all whitespace and control characters are collapsed to a single space, leading and trailing removed
+/// Code points outside of the Basic Multilingual Plane and invalid UTF-8 are copied as they are
+/// The result is never longer than the input, it is zero terminated if there is room for it.
+/// @return the length of the normalized text
+int normalizeText(char *text, int length, bool stripDiacritics);
@@ -0,0 +1,37 @@
+#include "TextNormalizeImpl.h"
+
+#include <immintrin.h>
+
+// Compiled with AVX2 enabled, normalizeText calls it only if the CPU has it
+
+namespace {
+
+struct Avx2Chunk {
+	static const int size = 32;
+
+	/// @return false if the chunk is not printable ASCII with single spaces, nothing is written then
+	static bool lower(const uint8_t *in, uint8_t *out, bool &lastSpace) {
+		const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in));
+		// signed compare also catches all bytes >= 0x80, DEL is a control character too
+		const uint32_t special = uint32_t(_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpgt_epi8(_mm256_set1_epi8(' '), chunk),
+			_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(0x7F)))));
+		const uint32_t spaces = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' '))));
+		if (special != 0 || (spaces & (spaces >> 1)) != 0 || (lastSpace && (spaces & 1))) {
+			return false;
+		}
+		const __m256i upper = _mm256_and_si256(
+			_mm256_cmpgt_epi8(chunk, _mm256_set1_epi8('A' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), chunk));
+		const __m256i lower = _mm256_or_si256(chunk, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out), lower);
+		lastSpace = (spaces >> 31) != 0;
+		return true;
+	}
+};
+
+}
+
+int textNormalize::normalizeAvx2(char *text, int length, bool stripDiacritics) {
+	return normalizeWith<Avx2Chunk>(text, length, stripDiacritics);
+}
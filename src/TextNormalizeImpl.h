@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+
+/// Internals of normalizeText shared by its baseline and its AVX2 build, only for TextNormalize*.cpp and tests.
+/// The loop is a template with internal linkage, so the copy compiled for AVX2 never stands in for the baseline one.
+/// A Chunk lower cases a run of printable ASCII with single spaces at once, anything else goes through the scalar path.
+namespace textNormalize {
+	uint32_t foldCase(uint32_t cp);
+
+	/// Expects already folded code point
+	uint32_t stripMark(uint32_t cp);
+
+	bool isCombiningMark(uint32_t cp);
+
+	bool isUnicodeSpace(uint32_t cp);
+
+#if NORMALIZE_HAS_AVX2
+	/// The CPU and the OS support AVX2
+	bool isAvx2Supported();
+
+	/// Built with AVX2 in its own file, only call if isAvx2Supported()
+	int normalizeAvx2(char *text, int length, bool stripDiacritics);
+#endif
+}
+
+namespace {
+
+/// No vector unit, every byte goes through the scalar path
+struct ScalarChunk {
+	static const int size = 1;
+
+	static bool lower(const uint8_t *, uint8_t *, bool &) {
+		return false;
+	}
+};
+
+template <class Chunk>
+int normalizeWith(char *text, int length, bool stripDiacritics) {
+	uint8_t *data = reinterpret_cast<uint8_t *>(text);
+	int in = 0;
+	int out = 0;
+	bool lastSpace = true; // true at start so leading whitespace is dropped
+
+	auto putSpace = [&]() {
+		if (!lastSpace) {
+			data[out++] = ' ';
+			lastSpace = true;
+		}
+	};
+
+	while (in < length) {
+		// Fast path for runs of printable ASCII with single spaces, which is most of the text
+		const int chunkEnd = in + Chunk::size;
+		if (chunkEnd <= length && Chunk::lower(data + in, data + out, lastSpace)) {
+			in += Chunk::size;
+			out += Chunk::size;
+			continue;
+		}
+		// Scalar path until the end of the chunk that failed the fast path
+		const int scalarEnd = chunkEnd < length ? chunkEnd : length;
+		while (in < scalarEnd) {
+			const uint8_t lead = data[in];
+			if (lead < 0x80) {
+				++in;
+				if (lead <= ' ' || lead == 0x7F) {
+					putSpace();
+				} else {
+					data[out++] = uint8_t(lead >= 'A' && lead <= 'Z' ? lead | 0x20 : lead);
+					lastSpace = false;
+				}
+				continue;
+			}
+
+			int seqLength = 0;
+			uint32_t cp = 0;
+			if (lead >= 0xC2 && lead <= 0xDF) {
+				seqLength = 2;
+				cp = lead & 0x1F;
+			} else if (lead >= 0xE0 && lead <= 0xEF) {
+				seqLength = 3;
+				cp = lead & 0x0F;
+			} else if (lead >= 0xF0 && lead <= 0xF4) {
+				seqLength = 4;
+				cp = lead & 0x07;
+			}
+			bool valid = seqLength != 0 && in + seqLength <= length;
+			for (int c = 1; valid && c < seqLength; c++) {
+				valid = (data[in + c] & 0xC0) == 0x80;
+				cp = (cp << 6) | (data[in + c] & 0x3F);
+			}
+			if (seqLength == 3 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) {
+				// overlong encoding or surrogate
+				valid = false;
+			}
+			if (!valid) {
+				// copy invalid bytes as they are
+				data[out++] = data[in++];
+				lastSpace = false;
+				continue;
+			}
+			in += seqLength;
+
+			if (textNormalize::isUnicodeSpace(cp)) {
+				putSpace();
+				continue;
+			}
+			if (seqLength == 4) {
+				// outside of the folded ranges, copy the original bytes
+				for (int c = seqLength; c > 0; c--) {
+					data[out++] = data[in - c];
+				}
+				lastSpace = false;
+				continue;
+			}
+
+			cp = textNormalize::foldCase(cp);
+			if (stripDiacritics) {
+				if (textNormalize::isCombiningMark(cp)) {
+					continue;
+				}
+				cp = textNormalize::stripMark(cp);
+			}
+			// folding never needs more bytes than the original sequence
+			if (cp == 0xDF) {
+				// sharp s folds to "ss" with the same length
+				data[out++] = 's';
+				data[out++] = 's';
+			} else if (cp < 0x80) {
+				data[out++] = uint8_t(cp);
+			} else if (cp < 0x800) {
+				data[out++] = uint8_t(0xC0 | (cp >> 6));
+				data[out++] = uint8_t(0x80 | (cp & 0x3F));
+			} else {
+				data[out++] = uint8_t(0xE0 | (cp >> 12));
+				data[out++] = uint8_t(0x80 | ((cp >> 6) & 0x3F));
+				data[out++] = uint8_t(0x80 | (cp & 0x3F));
+			}
+			lastSpace = false;
+		}
+	}
+
+	if (out > 0 && data[out - 1] == ' ') {
+		--out;
+	}
+	if (out < length) {
+		data[out] = 0;
+	}
+	return out;
+}
+
+}
@@ -0,0 +1,365 @@
+#include "Topology.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#if _WIN32
+
+bool CpuTopology::detect() {
+	cpus.clear();
+	DWORD length = 0;
+	GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+	std::vector<char> buffer(length);
+	if (length == 0 || !GetLogicalProcessorInformationEx(RelationAll, reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data()), &length)) {
+		return false;
+	}
+
+	std::map<int, int> packageOf, nodeOf;
+	int packageIdx = 0;
+	for (DWORD offset = 0; offset < length;) {
+		const auto *info = reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *>(buffer.data() + offset);
+		auto forEachCpu = [](const GROUP_AFFINITY &affinity, auto &&callback) {
+			for (int bit = 0; bit < 64; bit++) {
+				if (affinity.Mask & (KAFFINITY(1) << bit)) {
+					callback(int(affinity.Group) * 64 + bit);
+				}
+			}
+		};
+
+		if (info->Relationship == RelationProcessorCore) {
+			const int core = int(cpus.empty() ? 0 : cpus.back().core + 1);
+			for (int c = 0; c < int(info->Processor.GroupCount); c++) {
+				forEachCpu(info->Processor.GroupMask[c], [this, core](int id) {
+					Cpu cpu;
+					cpu.id = id;
+					cpu.core = core;
+					cpus.push_back(cpu);
+				});
+			}
+		} else if (info->Relationship == RelationProcessorPackage) {
+			for (int c = 0; c < int(info->Processor.GroupCount); c++) {
+				forEachCpu(info->Processor.GroupMask[c], [&packageOf, packageIdx](int id) {
+					packageOf[id] = packageIdx;
+				});
+			}
+			++packageIdx;
+		} else if (info->Relationship == RelationNumaNode) {
+			const int node = int(info->NumaNode.NodeNumber);
+			forEachCpu(info->NumaNode.GroupMask, [&nodeOf, node](int id) {
+				nodeOf[id] = node;
+			});
+		}
+		offset += info->Size;
+	}
+
+	for (Cpu &cpu : cpus) {
+		cpu.package = packageOf[cpu.id];
+		cpu.node = nodeOf[cpu.id];
+	}
+
+	// only the CPUs the process may run on, the mask is known when the process is in a single processor group
+	USHORT groupCount = 1;
+	USHORT group = 0;
+	DWORD_PTR processMask = 0, systemMask = 0;
+	if (GetProcessGroupAffinity(GetCurrentProcess(), &groupCount, &group) && groupCount == 1
+		&& GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+		cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [group, processMask](const Cpu &cpu) {
+			return cpu.id / 64 != group || (processMask & (DWORD_PTR(1) << (cpu.id % 64))) == 0;
+		}), cpus.end());
+	}
+	return !cpus.empty();
+}
+
+static bool pinThread(const std::vector<int> &cpuIds) {
+	if (cpuIds.empty()) {
+		return true;
+	}
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = WORD(cpuIds.front() / 64);
+	for (int id : cpuIds) {
+		// a thread can only be in one processor group
+		if (id / 64 == affinity.Group) {
+			affinity.Mask |= KAFFINITY(1) << (id % 64);
+		}
+	}
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+}
+
+#else
+
+static bool readLine(const char *path, std::string &line) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return false;
+	}
+	char buff[4096] = {0,};
+	const bool isRead = fgets(buff, sizeof(buff), file) != nullptr;
+	fclose(file);
+	line = buff;
+	return isRead;
+}
+
+/// Parse kernel cpu lists like "0-3,8,10-11"
+static std::vector<int> parseCpuList(const std::string &list) {
+	std::vector<int> result;
+	const char *it = list.c_str();
+	while (*it) {
+		int first = 0, last = 0, read = 0;
+		if (sscanf(it, "%d-%d%n", &first, &last, &read) != 2) {
+			if (sscanf(it, "%d%n", &first, &read) != 1) {
+				break;
+			}
+			last = first;
+		}
+		for (int c = first; c <= last; c++) {
+			result.push_back(c);
+		}
+		it += read;
+		if (*it == ',') {
+			++it;
+		}
+	}
+	return result;
+}
+
+bool CpuTopology::detect() {
+	cpus.clear();
+	std::string online, line;
+	if (!readLine("/sys/devices/system/cpu/online", online)) {
+		return false;
+	}
+
+	std::map<int, int> nodeOf;
+	for (int node = 0, missing = 0; missing < 64; node++) {
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (!readLine(path, line)) {
+			++missing; // node ids can have gaps
+			continue;
+		}
+		for (int id : parseCpuList(line)) {
+			nodeOf[id] = node;
+		}
+	}
+
+	// taskset, cgroup cpusets and the parent's affinity restrict the CPUs the process may run on
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	const bool hasAllowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	std::map<std::pair<int, int>, int> coreIds;
+	for (int id : parseCpuList(online)) {
+		if (hasAllowed && (id >= CPU_SETSIZE || !CPU_ISSET(id, &allowed))) {
+			continue;
+		}
+		char path[128];
+		std::string value;
+		Cpu cpu;
+		cpu.id = id;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", id);
+		cpu.package = readLine(path, value) ? atoi(value.c_str()) : 0;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", id);
+		const int coreId = readLine(path, value) ? atoi(value.c_str()) : id;
+		// core_id is only unique within a package
+		cpu.core = coreIds.emplace(std::make_pair(cpu.package, coreId), int(coreIds.size())).first->second;
+		cpu.node = nodeOf[id];
+		cpus.push_back(cpu);
+	}
+	return !cpus.empty();
+}
+
+static bool pinThread(const std::vector<int> &cpuIds) {
+	if (cpuIds.empty()) {
+		return true;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int id : cpuIds) {
+		if (id < CPU_SETSIZE) {
+			CPU_SET(id, &set);
+		}
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#endif
+
+int CpuTopology::coreCount() const {
+	std::set<int> cores;
+	for (const Cpu &cpu : cpus) {
+		cores.insert(cpu.core);
+	}
+	return int(cores.size());
+}
+
+int CpuTopology::packageCount() const {
+	std::set<int> packages;
+	for (const Cpu &cpu : cpus) {
+		packages.insert(cpu.package);
+	}
+	return int(packages.size());
+}
+
+int CpuTopology::nodeCount() const {
+	std::set<int> nodes;
+	for (const Cpu &cpu : cpus) {
+		nodes.insert(cpu.node);
+	}
+	return int(nodes.size());
+}
+
+PlacementPlan PlacementPlan::make(const CpuTopology &inTopology, const Settings &settings, int threadCount) {
+	PlacementPlan plan;
+	plan.pin = settings.pinThreads;
+	plan.engineThreads = std::max(1, settings.engineThreads);
+
+	CpuTopology topology = inTopology;
+	if (topology.cpus.empty()) {
+		const int count = std::max(1, int(std::thread::hardware_concurrency()));
+		for (int c = 0; c < count; c++) {
+			topology.cpus.push_back({c, c, 0, 0});
+		}
+	}
+
+	std::vector<CpuTopology::Cpu> cpus = topology.cpus;
+	std::sort(cpus.begin(), cpus.end(), [](const CpuTopology::Cpu &a, const CpuTopology::Cpu &b) {
+		return std::tie(a.node, a.package, a.core, a.id) < std::tie(b.node, b.package, b.core, b.id);
+	});
+
+	// first logical CPU of each core, in node order
+	std::vector<CpuTopology::Cpu> primary;
+	std::map<int, std::vector<int>> coreCpus;
+	for (const CpuTopology::Cpu &cpu : cpus) {
+		std::vector<int> &siblings = coreCpus[cpu.core];
+		if (siblings.empty()) {
+			primary.push_back(cpu);
+		}
+		siblings.push_back(cpu.id);
+	}
+
+	const int reserve = std::max(0, std::min(settings.reserveCores, int(primary.size()) - 1));
+	for (int c = 0; c < reserve; c++) {
+		const std::vector<int> &siblings = coreCpus[primary[c].core];
+		plan.reservedCpus.insert(plan.reservedCpus.end(), siblings.begin(), siblings.end());
+	}
+
+	// interleave the free cores over the NUMA nodes so few workers still use all memory controllers
+	std::map<int, std::vector<CpuTopology::Cpu>> freeByNode;
+	for (int c = reserve; c < int(primary.size()); c++) {
+		freeByNode[primary[c].node].push_back(primary[c]);
+	}
+	std::vector<CpuTopology::Cpu> order;
+	for (int round = 0; int(order.size()) < int(primary.size()) - reserve; round++) {
+		for (const auto &node : freeByNode) {
+			if (round < int(node.second.size())) {
+				order.push_back(node.second[round]);
+			}
+		}
+	}
+
+	const int freeCores = int(order.size());
+	const int workers = threadCount == -1 ? freeCores : std::max(1, threadCount);
+	for (int c = 0; c < workers; c++) {
+		const CpuTopology::Cpu &cpu = order[c % freeCores];
+		const std::vector<int> &siblings = coreCpus[cpu.core];
+		const int round = c / freeCores;
+		if (plan.engineThreads > 1) {
+			// engine threads inherit the worker affinity, give them the whole core
+			plan.workerCpus.push_back(siblings);
+		} else {
+			// more workers than cores, use the SMT siblings next
+			plan.workerCpus.push_back({siblings[round % siblings.size()]});
+		}
+	}
+	return plan;
+}
+
+static std::string cpuListToString(const std::vector<int> &cpus) {
+	std::string result;
+	for (int id : cpus) {
+		if (!result.empty()) {
+			result += ',';
+		}
+		result += std::to_string(id);
+	}
+	return result;
+}
+
+void PlacementPlan::print(const CpuTopology &topology) const {
+	printf("CPU topology: %d package(s), %d NUMA node(s), %d cores, %d logical CPUs\n",
+		topology.packageCount(), topology.nodeCount(), topology.coreCount(), int(topology.cpus.size()));
+	printf("Placement: %d OCR workers with %d engine thread(s) each, %s\n",
+		workerCount(), engineThreads, pin ? "pinned" : "not pinned");
+	printf("\tdecode/IO: cpus [%s]\n", cpuListToString(reservedCpus).c_str());
+	for (int c = 0; c < workerCount(); c++) {
+		printf("\tworker[%d]: cpus [%s]\n", c, cpuListToString(workerCpus[c]).c_str());
+	}
+}
+
+bool PlacementPlan::pinToReserved() const {
+	return !pin || pinThread(reservedCpus);
+}
+
+bool PlacementPlan::pinWorker(int idx) const {
+	return !pin || idx >= workerCount() || pinThread(workerCpus[idx]);
+}
+
+bool limitEngineThreads(int count, bool isSilent, char *argv[]) {
+	if (count <= 0 || getenv("OMP_THREAD_LIMIT")) {
+		return true;
+	}
+	char value[16];
+	snprintf(value, sizeof(value), "%d", count);
+	if (!isSilent) {
+		printf("Starting again with OMP_THREAD_LIMIT=%s to limit the engine threads\n", value);
+	}
+	fflush(stdout);
+#if _WIN32
+	(void)argv;
+	wchar_t path[MAX_PATH];
+	const DWORD length = GetModuleFileNameW(nullptr, path, MAX_PATH);
+	if (length == 0 || length == MAX_PATH || !SetEnvironmentVariableA("OMP_THREAD_LIMIT", value)) {
+		return false;
+	}
+	// the original command line is passed on as it is, so every argument reaches the child unchanged
+	std::wstring commandLine = GetCommandLineW();
+	STARTUPINFOW startup = {};
+	startup.cb = sizeof(startup);
+	PROCESS_INFORMATION process = {};
+	if (!CreateProcessW(path, &commandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process)) {
+		SetEnvironmentVariableA("OMP_THREAD_LIMIT", nullptr);
+		return false;
+	}
+	CloseHandle(process.hThread);
+	WaitForSingleObject(process.hProcess, INFINITE);
+	DWORD exitCode = 1;
+	GetExitCodeProcess(process.hProcess, &exitCode);
+	CloseHandle(process.hProcess);
+	exit(int(exitCode));
+#else
+	if (setenv("OMP_THREAD_LIMIT", value, 0) != 0) {
+		return false;
+	}
+	// returns only on failure
+	execv("/proc/self/exe", argv);
+	unsetenv("OMP_THREAD_LIMIT");
+	return false;
+#endif
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Utils.h"
+
+#include <vector>
+
+/// Logical CPUs of the machine grouped by physical core, package and NUMA node
+struct CpuTopology {
+	struct Cpu {
+		int id = 0; ///< OS index of the logical CPU
+		int core = 0; ///< Physical core, unique over all packages
+		int package = 0;
+		int node = 0;
+	};
+
+	/// Read the topology from the OS, only the CPUs in the affinity mask of the process are kept
+	bool detect();
+
+	int coreCount() const;
+	int packageCount() const;
+	int nodeCount() const;
+
+	std::vector<Cpu> cpus;
+};
+
+/// Which CPUs OCR workers run on and which are left to decode and IO
+struct PlacementPlan {
+	/// @param threadCount requested OCR workers, -1 to use one per free physical core
+	static PlacementPlan make(const CpuTopology &topology, const Settings &settings, int threadCount);
+
+	void print(const CpuTopology &topology) const;
+
+	/// Pin the calling thread to the reserved CPUs, threads it creates later (decoder) inherit this
+	/// @return false if the OS refused, the thread keeps running where it did
+	bool pinToReserved() const;
+
+	/// Pin the calling thread to the CPU of a worker
+	/// @return false if the OS refused, the thread keeps running where it did
+	bool pinWorker(int idx) const;
+
+	int workerCount() const {
+		return int(workerCpus.size());
+	}
+
+	bool pin = false;
+	int engineThreads = 1; ///< Internal threads of each recognition engine
+	std::vector<std::vector<int>> workerCpus; ///< CPU set of each OCR worker
+	std::vector<int> reservedCpus; ///< CPUs left for decode and IO
+};
+
+/// Limit the internal (OpenMP) threads of each recognition engine.
+/// The OpenMP runtime reads OMP_THREAD_LIMIT once when it is loaded, before main, and the engines ask for
+/// fixed team sizes that omp_set_num_threads does not override, so the limit is set and the program is started again.
+/// Does nothing if count is 0 or the limit is already in the environment, for example when Tesseract
+/// is built without OpenMP or the limit is set before starting. On success it does not return.
+/// @param count 0 leaves the OpenMP default of one thread per core
+/// @return false if the program could not be started again, the engines are not limited
+bool limitEngineThreads(int count, bool isSilent, char *argv[]);
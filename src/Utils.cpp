@@ -1,5 +1,11 @@
 #include "Utils.h"
 
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
 static const std::string ARGS_TEMPLATE =
 "{ help h usage    |        | Print this message }"
 "{ v video         |        | Path to video file to analyze }"
@@ -9,13 +15,49 @@ static const std::string ARGS_TEMPLATE =
 "{ silent          | 0      | Print only on error and match found }"
 "{ crop            | 0      | Crop image to upper/left 1/4th }"
 "{ verbose         | 0      | If set to true will write progress messages }"
-"{ threadCount     | -1     | Number of threads }"
+"{ stripDiacritics | 0      | Ignore diacritics when matching terms }"
+"{ threadCount     | -1     | Number of threads, -1 for one per physical core not reserved }"
+"{ reserveCores    | 1      | Physical cores left free for video decode and IO }"
+"{ engineThreads   | 0      | Internal threads of each Tesseract instance, set with OMP_THREAD_LIMIT by starting again, 0 for the OpenMP default }"
+"{ pinThreads      | 1      | Pin OCR threads to cores following the CPU topology }"
 "{ matchLimit      | 1      | Number of matches before matching stops }"
-"{ frameSkip       | 24     | Number of frames to skip }";
+"{ resultMemoryMB  | 1024   | Memory budget for frames of found matches }"
+"{ spillFrames     | 1      | Over budget frames are moved to disk, otherwise they are shrunk to thumbnails }"
+"{ spillDir        |        | Directory for spilled frames, system temporary directory if empty }"
+"{ daemon          |        | Run as daemon taking jobs on this Unix domain socket path }"
+"{ shard           |        | Process only shard i/n of the video, for example 0/4 }"
+"{ partialOut      |        | Write results to this file to be combined later with merge }"
+"{ merge           |        | Comma separated partial result files to combine, needs the same terms }"
+"{ profile         |        | Settings profile written by calibrate, arguments on the command line override it }"
+"{ calibrate       |        | Tune threadCount, frameSkip and upscale on a clip of the video (fromFrame to toFrame, 30s by default) and write a profile to this path }"
+"{ compileRules    |        | Compile the terms into a binary rulebook at this path and exit, it can be passed as terms }"
+"{ frameSkip       | 24     | Number of frames to skip }"
+"{ fromFrame       | 0      | First frame to process }"
+"{ toFrame         | -1     | Stop before this frame, -1 for the end of the video }"
+"{ sampleMs        | 0      | Sample a frame every this many ms by timestamp instead of by frame index }"
+"{ from            |        | Start time, seconds or hh:mm:ss, samples by timestamp }"
+"{ to              |        | End time, seconds or hh:mm:ss, samples by timestamp }"
+"{ intervals       |        | Comma separated time intervals like 1:00-2:30,10:00-, samples by timestamp }"
+"{ adaptiveStride  | 0      | Adapt the number of skipped frames to scene changes, between minStride and maxStride }"
+"{ minStride       | 6      | Frames to skip after a scene change when adaptiveStride is set }"
+"{ maxStride       | 240    | Frames to skip on static content when adaptiveStride is set }"
+"{ sceneChange     | 0.5    | Percent of changed pixels in a frame thumbnail that counts as scene change }"
+"{ sharpWindow     | 0      | Recognize the sharpest frame up to this many frames around each sample, after it with time based sampling }"
+"{ sharpFloor      | 0      | Skip samples where no frame is sharper than this, Laplacian variance of a 320 pixel wide thumbnail }"
+"{ upscale         | 4      | Zoom of the frame before recognition, small text is only read at 3-4 }"
+"{ fusionWindow    | 0      | Vote on the text of each region with the same region in this many samples on both sides }"
+"{ frameBudgetMs   | 0      | Give up on frames that take longer to recognize, 0 for no limit }"
+"{ regionTile      | 0      | Tile size in pixels to find changed regions, only those are recognized again, 0 to recognize whole frames }"
+"{ mosaic          | 0      | Pack the text regions of a frame into one small image recognized in a single pass }"
+"{ cascade         | 0      | Screen regions with the fast legacy engine at half the upscale, only lines that may hold a term get the full recognizer }"
+"{ ruleConstraints | 0      | Restrict the recognizer to the characters and words of the terms }";
 
 
 bool Settings::isValid() const {
-	return !videoPath.empty() && !termsFile.empty();
+	if (!mergeFiles.empty() || !compileRules.empty()) {
+		return !termsFile.empty();
+	}
+	return !daemonSocket.empty() || (!videoPath.empty() && !termsFile.empty());
 }
 
 bool Settings::checkAndPrint() const {
@@ -31,22 +73,95 @@ bool Settings::checkAndPrint() const {
 }
 
 
+/// Value of a -name=value or --name=value argument, empty if not given
+static std::string findArgument(int argc, char *argv[], const std::string &name) {
+	for (int c = 1; c < argc; c++) {
+		const char *arg = argv[c];
+		arg += arg[0] == '-';
+		arg += arg[0] == '-';
+		if (arg != argv[c] && strncmp(arg, name.c_str(), name.size()) == 0 && arg[name.size()] == '=') {
+			return arg + name.size() + 1;
+		}
+	}
+	return "";
+}
+
+/// Read the arguments of a profile, one per line, lines starting with # are comments
+static bool readProfile(const std::string &path, std::vector<std::string> &args) {
+	std::ifstream file(path);
+	if (!file) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		while (!line.empty() && isspace(uint8_t(line.back()))) {
+			line.pop_back();
+		}
+		if (!line.empty() && line[0] != '#') {
+			args.push_back(line);
+		}
+	}
+	return true;
+}
+
 Settings Settings::getSettings(int argc, char* argv[]) {
-	Settings sts(argc, argv, ARGS_TEMPLATE);
+	// profile arguments go first, the parser keeps the last value so the command line wins
+	std::vector<std::string> profileArgs;
+	const std::string profile = findArgument(argc, argv, "profile");
+	if (!profile.empty() && !readProfile(profile, profileArgs)) {
+		printf("Failed to read profile %s\n", profile.c_str());
+	}
+	std::vector<const char *> args(argv, argv + std::max(1, argc));
+	for (int c = 0; c < int(profileArgs.size()); c++) {
+		args.insert(args.begin() + 1 + c, profileArgs[c].c_str());
+	}
+	Settings sts(int(args.size()), args.data(), ARGS_TEMPLATE);
 
 	try {
 		sts.videoPath = sts.cmd.get<cv::String>("video");
 		sts.termsFile = sts.cmd.get<cv::String>("terms");
 		sts.resultDir = sts.cmd.get<cv::String>("resultDir");
+		sts.spillDir = sts.cmd.get<cv::String>("spillDir");
+		sts.daemonSocket = sts.cmd.get<cv::String>("daemon");
+		sts.shard = sts.cmd.get<cv::String>("shard");
+		sts.partialOut = sts.cmd.get<cv::String>("partialOut");
+		sts.mergeFiles = sts.cmd.get<cv::String>("merge");
+		sts.compileRules = sts.cmd.get<cv::String>("compileRules");
+		sts.calibrate = sts.cmd.get<cv::String>("calibrate");
+		sts.fromTime = sts.cmd.get<cv::String>("from");
+		sts.toTime = sts.cmd.get<cv::String>("to");
+		sts.intervals = sts.cmd.get<cv::String>("intervals");
 
 		sts.showFrame = sts.cmd.get<bool>("show");
 		sts.silent = sts.cmd.get<bool>("silent");
 		sts.doCrop = sts.cmd.get<bool>("crop");
 		sts.verbose = sts.cmd.get<bool>("verbose");
+		sts.stripDiacritics = sts.cmd.get<bool>("stripDiacritics");
 
 		sts.threadCount = sts.cmd.get<int>("threadCount");
+		sts.reserveCores = sts.cmd.get<int>("reserveCores");
+		sts.engineThreads = sts.cmd.get<int>("engineThreads");
+		sts.pinThreads = sts.cmd.get<bool>("pinThreads");
 		sts.matchLimit = sts.cmd.get<int>("matchLimit");
+		sts.resultMemoryMB = sts.cmd.get<int>("resultMemoryMB");
+		sts.spillFrames = sts.cmd.get<bool>("spillFrames");
 		sts.frameSkip = sts.cmd.get<int>("frameSkip");
+		sts.fromFrame = sts.cmd.get<int>("fromFrame");
+		sts.toFrame = sts.cmd.get<int>("toFrame");
+		sts.sampleMs = sts.cmd.get<int>("sampleMs");
+		sts.adaptiveStride = sts.cmd.get<bool>("adaptiveStride");
+		sts.minStride = sts.cmd.get<int>("minStride");
+		sts.maxStride = sts.cmd.get<int>("maxStride");
+		sts.sceneChange = sts.cmd.get<float>("sceneChange");
+		sts.upscale = sts.cmd.get<int>("upscale");
+		sts.sharpWindow = sts.cmd.get<int>("sharpWindow");
+		sts.sharpFloor = sts.cmd.get<float>("sharpFloor");
+		sts.fusionWindow = sts.cmd.get<int>("fusionWindow");
+		sts.frameBudgetMs = sts.cmd.get<int>("frameBudgetMs");
+		sts.regionTile = sts.cmd.get<int>("regionTile");
+		sts.mosaic = sts.cmd.get<bool>("mosaic");
+		sts.ruleConstraints = sts.cmd.get<bool>("ruleConstraints");
+		sts.cascade = sts.cmd.get<bool>("cascade");
 	} catch (cv::Exception &ex) {
 		puts(ex.what());
 	}
@@ -66,3 +181,32 @@ std::string timeToString(ms time) {
 	);
 	return buff;
 }
+
+bool parseTime(const std::string &text, ms &time) {
+	double parts[3] = {0., 0., 0.};
+	int count = 0;
+	const char *pos = text.c_str();
+	while (*pos && count < 3) {
+		char *end = nullptr;
+		parts[count++] = strtod(pos, &end);
+		if (end == pos || parts[count - 1] < 0.) {
+			return false;
+		}
+		pos = end;
+		if (*pos == ':') {
+			++pos;
+		} else {
+			break;
+		}
+	}
+	if (count == 0 || *pos) {
+		return false;
+	}
+
+	double seconds = 0.;
+	for (int c = 0; c < count; c++) {
+		seconds = seconds * 60. + parts[c];
+	}
+	time = ms(int64_t(seconds * 1000. + 0.5));
+	return true;
+}
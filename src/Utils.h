@@ -21,13 +21,45 @@ struct Settings {
 	std::string videoPath;
 	std::string termsFile;
 	std::string resultDir;
+	std::string spillDir;
+	std::string daemonSocket;
+	std::string shard;
+	std::string partialOut;
+	std::string mergeFiles;
+	std::string compileRules;
+	std::string calibrate;
+	std::string fromTime;
+	std::string toTime;
+	std::string intervals;
 	bool showFrame = true;
 	bool silent = false;
 	bool doCrop = false;
 	bool verbose = false;
+	bool stripDiacritics = false;
+	bool adaptiveStride = false;
+	bool pinThreads = true;
+	bool spillFrames = true;
 	int threadCount = -1;
+	int reserveCores = 1;
+	int engineThreads = 0;
 	int matchLimit = 1;
+	int resultMemoryMB = 1024;
 	int frameSkip = 24;
+	int fromFrame = 0;
+	int toFrame = -1;
+	int minStride = 6;
+	int maxStride = 240;
+	int upscale = 4;
+	int sharpWindow = 0;
+	int fusionWindow = 0;
+	int frameBudgetMs = 0;
+	int regionTile = 0;
+	int sampleMs = 0;
+	bool mosaic = false;
+	bool ruleConstraints = false;
+	bool cascade = false;
+	float sceneChange = 0.5f;
+	float sharpFloor = 0.f;
 
 	Settings(int argc, const char *const argv[], const std::string &format) : cmd(argc, argv, format) {}
 
@@ -41,3 +73,6 @@ struct Settings {
 using ms = std::chrono::milliseconds;
 
 std::string timeToString(ms time);
+
+/// Parse a time as seconds, mm:ss or hh:mm:ss, the seconds can have a fraction
+bool parseTime(const std::string &text, ms &time);
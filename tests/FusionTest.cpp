@@ -0,0 +1,83 @@
+#include "../src/Fusion.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static int failures = 0;
+
+static TextBlock makeBlock(const char *text, float confidence) {
+	const int length = int(strlen(text));
+	CharPtr data(new char[length + 1]);
+	memcpy(data.get(), text, length + 1);
+	return TextBlock{CharPtrView(std::move(data), length), cv::Rect(10, 10, 100, 20), confidence};
+}
+
+static void checkFused(const char *name, const FusedFrame &fused, int sampleIndex, int frameIndex, const char *text) {
+	const std::string reading = fused.blocks.empty() ? "" : fused.blocks.front().text.get();
+	if (fused.sampleIndex != sampleIndex || fused.frameIndex != frameIndex || reading != text) {
+		printf("%s: expected sample %d at frame %d [%s] got sample %d at frame %d [%s]\n", name,
+			sampleIndex, frameIndex, text, fused.sampleIndex, fused.frameIndex, reading.c_str());
+		++failures;
+	}
+}
+
+/// The same title read by three consecutive samples, the first one misread it
+static void testBestFrame() {
+	const char *argv[] = {"FusionTest"};
+	Settings settings(1, argv, "");
+	settings.fusionWindow = 1;
+	settings.frameSkip = 1;
+	FusionWindow window;
+	window.init(settings);
+
+	uint8_t pixels[3][3] = {};
+	cv::Mat frames[3];
+	const char *texts[3] = {"breakimg news", "breaking news", "breaking news"};
+	const float confidences[3] = {40.f, 90.f, 70.f};
+	for (int c = 0; c < 3; c++) {
+		frames[c] = cv::Mat(1, 1, CV_8UC3, pixels[c]);
+		BlockList blocks;
+		blocks.push_back(makeBlock(texts[c], confidences[c]));
+		window.add(c, ms(c * 40), frames[c], std::move(blocks));
+	}
+
+	// the misread of frame 0 loses to the more confident reading of frame 1, which is the best frame
+	FusedFrame fused;
+	if (!window.next(INT_MAX, fused)) {
+		puts("first sample: not voted");
+		++failures;
+		return;
+	}
+	checkFused("first sample", fused, 0, 1, "breaking news");
+	if (fused.frameTime != ms(40) || fused.frame.data != frames[1].data) {
+		puts("first sample: time or frame not of frame 1");
+		++failures;
+	}
+	window.claim(fused.frameIndex);
+
+	// frame 1 is reported already, frame 2 also read the winner
+	window.next(INT_MAX, fused);
+	checkFused("second sample", fused, 1, 2, "breaking news");
+	window.claim(fused.frameIndex);
+
+	// every frame that read the winner is reported
+	window.next(INT_MAX, fused);
+	checkFused("third sample", fused, 2, -1, "breaking news");
+
+	if (window.next(INT_MAX, fused)) {
+		puts("voted past the last sample");
+		++failures;
+	}
+}
+
+int main() {
+	testBestFrame();
+	if (failures != 0) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	puts("All checks passed");
+	return 0;
+}
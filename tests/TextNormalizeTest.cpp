@@ -0,0 +1,142 @@
+#include "../src/TextNormalize.h"
+#include "../src/TextNormalizeImpl.h"
+
+#include <cstdio>
+#include <string>
+
+static int failures = 0;
+
+static std::string normalized(std::string text, bool stripDiacritics = false) {
+	const int length = normalizeText(&text[0], int(text.size()), stripDiacritics);
+	return text.substr(0, size_t(length));
+}
+
+static void check(const char *name, const std::string &text, const std::string &expected, bool stripDiacritics = false) {
+	const std::string result = normalized(text, stripDiacritics);
+	if (result != expected) {
+		printf("%s: expected [%s] got [%s]\n", name, expected.c_str(), result.c_str());
+		++failures;
+	}
+}
+
+/// 39 printable characters, one AVX2 or two SSE2 chunks and a scalar tail
+static const std::string plain = "Lorem IPSUM dolor sit amet Consectetur.";
+
+/// DEL is a control character and must become a space the same way inside a vector chunk and in the scalar tail
+static void checkDelete(const char *name, int position) {
+	std::string withDelete = plain;
+	withDelete[position] = 0x7F;
+	std::string withSpace = plain;
+	withSpace[position] = ' ';
+	check(name, withDelete, normalized(withSpace));
+}
+
+static void testFolding() {
+	check("plain", plain, "lorem ipsum dolor sit amet consectetur.");
+	check("Latin", "ÀÉÎÕÜ Çß ǄŸ Ĳ", "àéîõü çss ǆÿ ĳ");
+	check("Greek", "ΑΒΓ ΣΟΦΙΑ Ϊ ς Ά", "αβγ σοφια ϊ σ ά");
+	check("Cyrillic", "ЁЛКА Привет Ѣ Ӂ", "ёлка привет ѣ ӂ");
+	check("Armenian", "ԲԱՐԵՎ", "բարեվ");
+	check("capital sharp s", "ẞ STRAẞE", "ss strasse");
+	check("Latin Extended Additional", "ẠẢḀ", "ạảḁ");
+	check("Georgian", "ႠႡ ᲐᲑ", "ⴀⴁ აბ");
+	check("Greek Extended", "ἈᾈΌ", "ἀᾀό");
+	check("Cherokee", "ꭰꭱ", "ᎠᎡ");
+	check("fullwidth and Kelvin sign", "ＡＢ \xe2\x84\xaa", "ａｂ k");
+	check("diacritics kept", "Crème Ἀθῆναι", "crème ἀθῆναι");
+}
+
+static void testStripDiacritics() {
+	check("strip Latin", "Crème Brûlée ÅNGSTRÖM", "creme brulee angstrom", true);
+	check("strip Vietnamese", "Tiếng Việt", "tieng viet", true);
+	check("strip Greek", "Ἀθῆναι ΆΈ ᾈ", "αθηναι αε α", true);
+	check("strip Cyrillic", "Йод Ёж", "иод еж", true);
+	check("strip combining marks", "e\xcc\x81 a\xe2\x83\x90 o\xe1\xb7\x80", "e a o", true);
+	check("strip keeps sharp s", "ẞ", "ss", true);
+	check("strip keeps Georgian", "Ⴀ", "ⴀ", true);
+}
+
+static void testWhitespace() {
+	check("whitespace", "  a\t\tb \n c\xc2\xa0\xe2\x80\x83" "d\xe3\x80\x80 ", "a b c d");
+	check("control characters", "\x01" "a\x1f\x7f" "b\r\n", "a b");
+	check("only whitespace", " \t\xe2\x80\x83 ", "");
+	check("empty", "", "");
+}
+
+static void testLength() {
+	// shorter result is terminated
+	char folded[] = "\xe1\xba\x9e" "A  ";
+	int length = normalizeText(folded, 6, false);
+	if (length != 3 || std::string(folded) != "ssa") {
+		printf("folded length: expected 3 [ssa] got %d [%s]\n", length, folded);
+		++failures;
+	}
+
+	// no room for the terminator, nothing is written past the text
+	char full[] = "abcX";
+	length = normalizeText(full, 3, false);
+	if (length != 3 || std::string(full) != "abcX") {
+		printf("full length: expected 3 [abcX] got %d [%s]\n", length, full);
+		++failures;
+	}
+}
+
+static void testInvalid() {
+	check("invalid byte", "A\xff" "B", "a\xff" "b");
+	check("lone continuation", "\x80" "A", "\x80" "a");
+	check("truncated 2 bytes", "A\xc3", "a\xc3");
+	check("truncated 3 bytes", "\xe1\xba", "\xe1\xba");
+	check("interrupted 3 bytes", "\xe1\xba" "A", "\xe1\xba" "a");
+	check("truncated 4 bytes", "\xf0\x9f\x98", "\xf0\x9f\x98");
+	check("overlong", "\xe0\x80\x80", "\xe0\x80\x80");
+	check("overlong space", "a\xe0\x82\xa0" "b", "a\xe0\x82\xa0" "b");
+	check("surrogate", "\xed\xa0\x80", "\xed\xa0\x80");
+	check("4 bytes copied", "A\xf0\x9f\x98\x80", "a\xf0\x9f\x98\x80");
+}
+
+/// The vector kernels must give the scalar result wherever a special sequence falls relative to a chunk boundary
+static void testChunkBoundaries() {
+	const char *pieces[] = {"É", "ẞ", "Ω", " ", "  ", "\t", "\x7f", "\xe1\xba", "\xc3", "\xf0\x9f\x98\x80"};
+	const std::string text = plain + " " + plain;
+	for (const char *piece : pieces) {
+		for (size_t position = 0; position <= text.size(); position++) {
+			for (int strip = 0; strip < 2; strip++) {
+				const std::string input = text.substr(0, position) + piece + text.substr(position);
+				std::string scalar = input;
+				scalar.resize(size_t(normalizeWith<ScalarChunk>(&scalar[0], int(scalar.size()), strip != 0)));
+				std::string result = normalized(input, strip != 0);
+#if NORMALIZE_HAS_AVX2
+				if (textNormalize::isAvx2Supported()) {
+					std::string avx2 = input;
+					avx2.resize(size_t(textNormalize::normalizeAvx2(&avx2[0], int(avx2.size()), strip != 0)));
+					if (avx2 != scalar) {
+						result = avx2;
+					}
+				}
+#endif
+				if (result != scalar) {
+					printf("chunk boundary at %d: expected [%s] got [%s]\n", int(position), scalar.c_str(), result.c_str());
+					++failures;
+				}
+			}
+		}
+	}
+}
+
+int main() {
+	testFolding();
+	checkDelete("DEL in chunk", 2);
+	checkDelete("DEL in tail", 35);
+	testStripDiacritics();
+	testWhitespace();
+	testLength();
+	testInvalid();
+	testChunkBoundaries();
+
+	if (failures != 0) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	puts("All checks passed");
+	return 0;
+}